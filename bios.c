@@ -11,13 +11,26 @@
 #include <sys/select.h>
 #include <sys/signalfd.h>
 #include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define BIOS_TSC_CLOCK
+#endif
+
 #include "util.h"
 #include "bios.h"
 
+/* Older glibc does not define this */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
@@ -25,9 +38,16 @@
 	Basic idea:
 	- Each core is simulated by a pthread
 	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- Core threads mask all signals except for USR1 and ALRM.
+	- Each core timer signals its own core thread directly (SIGALRM),
+	and the ALARM interrupt is raised and dispatched locally.
+	- The PIC thread only serves the devices, and dispatches their 
+	interrupts to the right core thread by raising SIGUSR1.
+	- Halted cores sleep on a per-core futex, and are woken up
+	without any signal.
+	- Core interrupts are disabled by a per-core software flag, not
+	by masking SIGUSR1. Interrupts raised while disabled stay pending 
+	and are dispatched when interrupts are enabled again.
 
  */
 
@@ -52,6 +72,8 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	uint32_t halted;	/* futex word, non-zero while the core is halted */
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -73,9 +95,6 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
 
@@ -103,11 +122,23 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
+/* Save the sigaction for SIGALRM */
+static struct sigaction ALRM_saved_sigaction;
+
+/* The sigaction for SIGALRM (core timers) */
+static struct sigaction ALRM_sigaction;
+
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300000
 
 /* Forward decl. of per-core signal handler */
-static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
+static void sigusr1_handler(int signo);
+
+/* Forward decl. of per-core timer signal handler */
+static void sigalrm_handler(int signo);
+
+/* Forward decl. of the clock source initialization */
+static void clock_source_init();
 
 /* PIC daemon statistics */
 static unsigned long PIC_loops;
@@ -122,27 +153,30 @@ static void initialize()
 {
 	physical_cores = get_nprocs();
 
-	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* Select and calibrate the bios clock */
+	clock_source_init();
+
+	USR1_sigaction.sa_handler = sigusr1_handler;
+	/* SA_NODEFER: while the handler runs, interrupts are disabled by the software flag */
+	USR1_sigaction.sa_flags = SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
-	/* Create the sigmask to block all signals, except USR1 */
+	ALRM_sigaction.sa_handler = sigalrm_handler;
+	ALRM_sigaction.sa_flags = SA_NODEFER;
+	sigemptyset(& ALRM_sigaction.sa_mask);
+
+	/* Create the sigmask to block all signals, except USR1 and ALRM */
 	CHECK(sigfillset(&core_signal_set));
 	CHECK(sigdelset(&core_signal_set, SIGUSR1));
+	CHECK(sigdelset(&core_signal_set, SIGALRM));
 
 	/* Create the mask for blocking SIGUSR1 */
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
 	/* Create signaldf_set */
 	CHECK(sigemptyset(&signalfd_set));
 	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -157,6 +191,20 @@ static inline Core* curr_core() {
 }
 
 
+/*
+	The interrupt enable flag of the current core. 
+
+	This is thread-local to the core thread, like the signal mask it
+	replaces. A kernel thread can be switched to a different core inside an 
+	interrupt handler, so the flag must not be accessed through a Core* 
+	computed earlier. With the initial-exec TLS model, every access is a 
+	single %fs-relative instruction, which always refers to the core 
+	the code is running on.
+ */
+static _Thread_local volatile sig_atomic_t intr_enabled
+	__attribute__((tls_model("initial-exec")));
+
+
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
 	the PIC daemon to refresh the list of fds it is polling.
@@ -180,6 +228,7 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->halted = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -187,11 +236,15 @@ static void* core_thread(void* _core)
 
 	cpu_core_id = core->id;
 
+	/* Interrupts are initially enabled */
+	intr_enabled = 1;
+
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
+	/* create a thread-specific timer, signalling this thread only */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_notify_thread_id = syscall(SYS_gettid);
 	core->timer_sigevent.sigev_signo = SIGALRM;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
 	// Could also be CLOCK_REALTIME
@@ -273,13 +326,45 @@ static inline int intr_fetch_lowest(Core* core, Interrupt* intp)
 }
 
 
+/*
+	Futex helpers, used to halt and restart cores.
+ */
+static inline void futex_wait(uint32_t* addr, uint32_t val)
+{
+	int rc = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+	assert(rc==0 || errno==EAGAIN || errno==EINTR);
+}
+
+static inline void futex_wake(uint32_t* addr)
+{
+	CHECK(syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+}
+
+
+/*
+	Wake up the core, if it is halted. Return 1 if the core was halted.
+ */
+static inline int wake_core(Core* core)
+{
+	if(__atomic_exchange_n(& core->halted, 0, __ATOMIC_SEQ_CST)) {
+		futex_wake(& core->halted);
+		return 1;
+	}
+	return 0;
+}
+
+
 /* 
 	Cause the given core to be interrupted in the future.
 	This function does not add a pending interrupt, but
-	causes a signal to be sent to the core.
+	causes a signal to be sent to the core. A halted core
+	is simply woken up, and it will dispatch its pending interrupts.
  */
 static inline void interrupt_core(Core* core)
 {
+	if(__atomic_load_n(& core->halted, __ATOMIC_SEQ_CST) && wake_core(core))
+		return;
+
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;	
@@ -342,18 +427,66 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Dispatch any pending interrupts with interrupts disabled, as a
+	hardware core would, and then enable interrupts. 
+
+	Interrupts raised during the dispatch are deferred, so the 
+	dispatch is repeated until nothing is pending.
+ */
+static void dispatch_interrupts_and_enable()
+{
+	do {
+		intr_enabled = 0;
+		dispatch_interrupts(curr_core());
+
+		/* We may be at a different core now */
+		intr_enabled = 1;
+	} while(curr_core()->intr_pending);
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
+	If interrupts are disabled, the interrupts are left pending, to be 
+	dispatched by cpu_enable_interrupts().
  */
-static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
+static void sigusr1_handler(int signo __attribute__((unused)))
 {
-	Core* core = & CORE[si->si_value.sival_int];
+#if defined(CORE_STATISTICS)
+	curr_core()->irq_count++;
+#endif
+
+	if(intr_enabled)
+		dispatch_interrupts_and_enable();
+}
+
+
+/*
+	This is the signal handler for the core timer. The timer signals
+	the core thread itself, so the ALARM interrupt is raised locally, 
+	without a round trip through the PIC daemon.
+
+	If the core is halted, the signal may have arrived just before it
+	went to sleep on its futex, so it is woken up as well.
+ */
+static void sigalrm_handler(int signo __attribute__((unused)))
+{
+	Core* core = curr_core();
 
 #if defined(CORE_STATISTICS)
 	core->irq_count++;
 #endif
 
-	dispatch_interrupts(core);
+	if(! intr_fetch_set(core, ALARM)) {
+#if defined(CORE_STATISTICS)
+		core->irq_raised[ALARM] ++;
+#endif
+		wake_core(core);
+	}
+
+	if(intr_enabled)
+		dispatch_interrupts_and_enable();
 }
 
 
@@ -362,12 +495,108 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
  */
 
 
-/* Coarse clock */
-static TimerDuration get_coarse_time()
+/*
+	Clock sources.
+
+	The bios clock is monotonic, with sub-microsecond resolution, and is
+	read by one of the following sources:
+	- CLOCK_MONOTONIC, via clock_gettime(), which does not enter the kernel
+	  (it is served by the vDSO).
+	- The TSC of x86-64 processors with an invariant TSC, calibrated against
+	  CLOCK_MONOTONIC at boot. This is a single instruction and a multiply.
+
+	The source is selected at boot by the TINYOS_CLOCK environment variable,
+	which can be "tsc" or "monotonic"; any other value is a fatal error.
+	By default, the TSC is used if it is invariant.
+
+	The TSC clock starts at the CLOCK_MONOTONIC time of its calibration, 
+	but it is an independent time base: its rate is only accurate to about
+	1e-4, and it is never re-synchronized, so the two clocks drift apart.
+	Therefore, bios clock values must not be mixed with CLOCK_MONOTONIC
+	deadlines. The core timers are always armed with relative delays,
+	computed from bios clock values only.
+ */
+typedef enum clock_source
+{
+	CLOCK_SOURCE_MONOTONIC,
+	CLOCK_SOURCE_TSC
+} clock_source;
+
+static clock_source bios_clock_source = CLOCK_SOURCE_MONOTONIC;
+
+/* Monotonic clock in nanoseconds */
+static uint64_t get_monotonic_nsec()
 {
 	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME_COARSE, &curtime));
-	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec + curtime.tv_sec*1000000000ull;
+}
+
+#if defined(BIOS_TSC_CLOCK)
+
+/* TSC calibration: usec = tsc_base_usec + ((tsc - tsc_base) * tsc_scale) >> 32 */
+static uint64_t tsc_base;
+static TimerDuration tsc_base_usec;
+static uint64_t tsc_scale;
+
+/* The calibration period, in nsec */
+#define TSC_CALIBRATION_TIME 5000000ull
+
+static int tsc_is_invariant()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if(! __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return 0;
+	return (edx & (1u << 8)) != 0;
+}
+
+static void tsc_calibrate()
+{
+	uint64_t t0 = get_monotonic_nsec();
+	uint64_t c0 = __rdtsc();
+	uint64_t t1, c1;
+	do {
+		t1 = get_monotonic_nsec();
+		c1 = __rdtsc();
+	} while(t1 - t0 < TSC_CALIBRATION_TIME);
+
+	/* tsc_scale = 2^32 usec per tick */
+	tsc_scale = (uint64_t) (((unsigned __int128)(t1 - t0) << 32) / ((c1 - c0) * 1000ull));
+	tsc_base = c1;
+	tsc_base_usec = t1 / 1000ull;
+}
+
+#endif
+
+static void clock_source_init()
+{
+	const char* name = getenv("TINYOS_CLOCK");
+	bios_clock_source = CLOCK_SOURCE_MONOTONIC;
+
+	if(name != NULL && strcmp(name, "tsc")!=0 && strcmp(name, "monotonic")!=0)
+		FATAL("TINYOS_CLOCK must be \"tsc\" or \"monotonic\"");
+
+#if defined(BIOS_TSC_CLOCK)
+	int want_tsc = (name == NULL) ? tsc_is_invariant() : strcmp(name, "tsc")==0;
+	if(want_tsc) {
+		tsc_calibrate();
+		bios_clock_source = CLOCK_SOURCE_TSC;
+	}
+#else
+	if(name != NULL && strcmp(name, "tsc")==0)
+		fprintf(stderr, "TINYOS_CLOCK: no TSC on this machine, using the monotonic clock\n");
+#endif
+}
+
+/* The bios clock, in microseconds */
+static inline TimerDuration get_clock_time()
+{
+#if defined(BIOS_TSC_CLOCK)
+	if(bios_clock_source == CLOCK_SOURCE_TSC) {
+		uint64_t ticks = __rdtsc() - tsc_base;
+		return tsc_base_usec + (TimerDuration) (((unsigned __int128) ticks * tsc_scale) >> 32);
+	}
+#endif
+	return get_monotonic_nsec() / 1000ull;
 }
 
 
@@ -457,7 +686,7 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
 	this->ready = io_device_ready(fd, iodir);
-	this->last_int = get_coarse_time();
+	this->last_int = get_clock_time();
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
@@ -662,7 +891,7 @@ static int pic_select(pic_selector* ps)
 		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
 	} else {
 		/* update system clock */
-		ps->system_clock = get_coarse_time();
+		ps->system_clock = get_clock_time();
 	}
 	return selcode;
 }
@@ -724,7 +953,6 @@ static void PIC_daemon(void)
 
 	/* Open signal queues */
 	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
@@ -743,7 +971,6 @@ static void PIC_daemon(void)
 		for(uint i=0; i<nterm; i++)
 			pic_add_terminal(&ps, & TERM[i]);
 
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
 		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
 
 		if(pic_select(&ps) == -1)
@@ -751,16 +978,6 @@ static void PIC_daemon(void)
 
 		PIC_loops++ ;
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
-		}
-
-
 		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
 			drain_signalfd(sigusr1fd);
 		}
@@ -782,7 +999,6 @@ static void PIC_daemon(void)
 
 	/* Close signal fds */
 	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -883,6 +1099,9 @@ void vm_run(vm_config* vmc)
 	/* Install signal handler for SIGUSR1 */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
 
+	/* Install signal handler for SIGALRM */
+	CHECK(sigaction(SIGALRM, &ALRM_sigaction, &ALRM_saved_sigaction));
+
 	/* Set pic_active to 1 */
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
@@ -918,7 +1137,7 @@ void vm_run(vm_config* vmc)
 			CORE[c].hlt_count = 0;
 			CORE[c].rst_count = 0;
 			CORE[c].hlt_time = 0;
-			CORE[c].run_time = get_coarse_time();
+			CORE[c].run_time = get_clock_time();
 		}
 #endif
 
@@ -940,7 +1159,7 @@ void vm_run(vm_config* vmc)
 		CHECKRC(pthread_join(CORE[c].thread, NULL));
 
 #if defined(CORE_STATISTICS)
-		CORE[c].run_time = get_coarse_time() - CORE[c].run_time;
+		CORE[c].run_time = get_clock_time() - CORE[c].run_time;
 #endif
 	}
 
@@ -958,6 +1177,7 @@ void vm_run(vm_config* vmc)
 
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECK(sigaction(SIGALRM, &ALRM_saved_sigaction, NULL));
 
 
 	/* print statistics */
@@ -996,15 +1216,19 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	/* Interrupts raised while halted are deferred by the interrupt flag */
+	int enabled = cpu_disable_interrupts();
 
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
 
 #if defined(CORE_STATISTICS)
-	TimerDuration stime0 = get_coarse_time();
+	TimerDuration stime0 = get_clock_time();
 #endif
 
+	/* Set the futex word before the halt bit, and before checking for interrupts */
+	__atomic_store_n(& core->halted, 1, __ATOMIC_SEQ_CST);
+
 	/* Set halt bit */
 	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
 
@@ -1012,29 +1236,24 @@ void cpu_core_halt()
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
-	}
+	/* 
+		Sleep until restarted, or until some interrupt is raised.
+		A waker clears core->halted before waking us. 
+	 */
+	while(__atomic_load_n(& core->halted, __ATOMIC_SEQ_CST) && ! core->intr_pending)
+		futex_wait(& core->halted, 1);
 
 #if defined(CORE_STATISTICS)
 	/* Unset halt bit */
-	core->hlt_time += get_coarse_time()-stime0;
+	core->hlt_time += get_clock_time()-stime0;
 #endif
 
+	__atomic_store_n(& core->halted, 0, __ATOMIC_RELAXED);
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	/* Dispatch pending interrupts, if any */
+	if(enabled) 
+		cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
@@ -1043,7 +1262,7 @@ static int __core_restart(uint c)
 
 	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 	if( prevhv & cmask ) {
-		interrupt_core(CORE+c);
+		wake_core(CORE+c);
 #if defined(CORE_STATISTICS)		
 		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
 #endif
@@ -1092,32 +1311,147 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return intr_enabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	/* 
+		If an interrupt is delivered between these two lines, it is dispatched
+		and the flag is re-enabled before we clear it, at whatever core we are on.
+	 */
+	int enabled = intr_enabled;
+	intr_enabled = 0;
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	intr_enabled = 1;
+
+	/* Replay the interrupts that were deferred */
+	if(curr_core()->intr_pending)
+		dispatch_interrupts_and_enable();
 }
 
 
+/*
+	Context switching.
+
+	On x86-64, a context switch is done by a hand-written routine,
+	bios_ctx_switch(), which pushes the callee-saved registers (and the
+	SSE/x87 control words) on the current stack, stores the stack pointer
+	in the old context, loads the stack pointer of the new context and pops
+	its registers. The caller-saved registers are already saved by the
+	compiler around the call. Thus, a switch costs a few dozen instructions.
+
+	Unlike swapcontext(), the signal mask is not part of the context, and no
+	sigprocmask syscall is made. This is correct because interrupts are disabled
+	by a software flag, and the signal mask of a core thread never changes 
+	across a switch.
+
+	The saved stack pointer is stored inside the cpu_context_t object, so the
+	cpu_context_t type is unchanged.
+
+	On other architectures, or if BIOS_UCONTEXT_SWITCH is defined, the
+	portable getcontext/makecontext/swapcontext implementation is used.
+ */
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT_SWITCH)
+
+typedef struct fast_context
+{
+	void* sp;	/* The saved stack pointer */
+} fast_context;
+
+_Static_assert(sizeof(fast_context) <= sizeof(cpu_context_t), "cpu_context_t is too small");
+
+/* void bios_ctx_switch(void** oldsp, void* newsp) */
+void bios_ctx_switch(void** oldsp, void* newsp);
+
+/* The first code executed by a new context; the context function is in %r12 */
+void bios_ctx_trampoline(void);
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.type bios_ctx_switch, @function\n"
+	"bios_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size bios_ctx_switch, .-bios_ctx_switch\n"
+	"	.p2align 4\n"
+	"	.type bios_ctx_trampoline, @function\n"
+	"bios_ctx_trampoline:\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	"	.size bios_ctx_trampoline, .-bios_ctx_trampoline\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	fast_context* fctx = (fast_context*) ctx;
+
+	/* The top of the stack, 16-byte aligned */
+	uint64_t* top = (uint64_t*) (((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15);
+
+	/* 
+		Build the frame popped by bios_ctx_switch(). When the switch returns
+		to bios_ctx_trampoline, the stack is 16-byte aligned for the call
+		to ctx_func.
+	 */
+	uint64_t* sp = top - 8;
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+	__asm__ volatile ("fnstcw %0" : "=m" (fpucw));
+
+	sp[0] = mxcsr | ((uint64_t)fpucw << 32);	/* control words */
+	sp[1] = 0;									/* r15 */
+	sp[2] = 0;									/* r14 */
+	sp[3] = 0;									/* r13 */
+	sp[4] = (uintptr_t) ctx_func;				/* r12 */
+	sp[5] = 0;									/* rbx */
+	sp[6] = 0;									/* rbp */
+	sp[7] = (uintptr_t) bios_ctx_trampoline;	/* return address */
+
+	fctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	bios_ctx_switch(& ((fast_context*)oldctx)->sp, ((fast_context*)newctx)->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1463,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* The core signal mask; interrupts are disabled by the software flag */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1474,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -1159,6 +1495,7 @@ TimerDuration bios_set_timer(TimerDuration usec)
 
 	struct itimerspec oldtime;
 	
+	/* A relative timer, so that it does not depend on the bios clock source */
 	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
@@ -1173,7 +1510,7 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return get_coarse_time();
+	return get_clock_time();
 }	
 
 
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <sys/mman.h>
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
@@ -15,60 +16,244 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table. 
+
+  This is a directory of chunks of PT_CHUNK_SIZE PCBs. The PCB of slot s
+  is at PT[s >> PT_CHUNK_BITS][s % PT_CHUNK_SIZE], and PID p is at slot
+  PID_SLOT(p). Chunks are allocated in order, when there is no free PCB
+  to reuse, and are never released, so get_pcb() can read the directory
+  without a lock.
+*/
+PCB* PT[PT_CHUNKS];
+unsigned int pt_chunks;
 unsigned int process_count;
 
+/* 
+  Occupancy bitmap of the process table: bit s is set while the PCB of
+  slot s is in use (ALIVE or ZOMBIE), or the slot holds zombie records. 
+  It is used to skip free slots quickly.
+*/
+#define PT_MAP_WORDS ((MAX_PROC + 63) / 64)
+static uint64_t pt_occupied[PT_MAP_WORDS];
+
+static inline void pt_occupied_set(unsigned int slot)
+{
+  __atomic_fetch_or(& pt_occupied[slot / 64], 1ull << (slot % 64), __ATOMIC_RELAXED);
+}
+
+static inline void pt_occupied_clear(unsigned int slot)
+{
+  __atomic_fetch_and(& pt_occupied[slot / 64], ~(1ull << (slot % 64)), __ATOMIC_RELAXED);
+}
+
+/* Return the first slot >= slot which is in use, or MAX_PROC if there is none */
+static unsigned int pt_next_occupied(unsigned int slot)
+{
+  while(slot < MAX_PROC) {
+    uint64_t word = __atomic_load_n(& pt_occupied[slot / 64], __ATOMIC_RELAXED);
+    word &= ~0ull << (slot % 64);
+    if(word != 0) 
+      return (slot & ~63) + __builtin_ctzll(word);
+    slot = (slot & ~63) + 64;
+  }
+  return MAX_PROC;
+}
+
+/* Return the PCB of a slot, or NULL if its chunk is not allocated */
+static inline PCB* pt_slot(unsigned int slot)
+{
+  PCB* chunk = __atomic_load_n(& PT[slot >> PT_CHUNK_BITS], __ATOMIC_ACQUIRE);
+  return (chunk == NULL) ? NULL : & chunk[slot & (PT_CHUNK_SIZE-1)];
+}
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  if(pid < 0) return NULL;
+
+  PCB* pcb = pt_slot(PID_SLOT(pid));
+  if(pcb == NULL) return NULL;
+
+  /* A stale pid has an older generation */
+  return (pcb->pstate!=ALIVE || pcb->pid != pid) ? NULL : pcb;
+}
+
+Zombie* get_zombie(Pid_t pid)
+{
+  if(pid < 0) return NULL;
+
+  PCB* pcb = pt_slot(PID_SLOT(pid));
+  if(pcb == NULL) return NULL;
+
+  for(rlnode* p = pcb->zombies.next; p != & pcb->zombies; p = p->next)
+    if(((Zombie*) p->obj)->pid == pid)
+      return p->obj;
+  return NULL;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 /* Initialize a PCB */
-static inline void initialize_PCB(PCB* pcb)
+static inline void initialize_PCB(PCB* pcb, Pid_t pid)
 {
+  pcb->pid = pid;
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
+  pcb->argbuf = NULL;
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
 
 
   pcb->thread_count = 0;
+  memset(& pcb->usage, 0, sizeof(proc_usage));
+  pcb->group = NULL;
+  pcb->autoreap = 0;
   rlnode_init(&pcb->ptcb_list,NULL);
 
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
   rlnode_init(& pcb->children_node, pcb);
-  rlnode_init(& pcb->exited_node, pcb);
+  rlnode_init(& pcb->zombies, NULL);
   pcb->child_exit = COND_INIT;
+  pcb->exit_cv = COND_INIT;
+  rlnode_init(& pcb->exit_handles, NULL);
   
 }
 
 
-static PCB* pcb_freelist;
+/*
+  PID allocation.
+
+  Free PCBs are kept in a global FIFO pool, threaded through the parent
+  field and protected by pid_pool_spinlock. Each core acquires PCBs from the
+  pool, and releases them to it, in batches of PID_BATCH, so that most PID
+  allocations only touch the core's own cache, with preemption off.
+
+  Each release of a PCB advances the generation in its PID, so a stale PID
+  is not confused with the next process in the slot. A generation still
+  held by an unreaped zombie of the slot is skipped. In addition, a PCB
+  is not reused before PID_REUSE_DELAY other PCBs have been released after
+  it, if the process table can grow instead, so that slots are recycled
+  slowly and generations wrap around late. To this end, the pool counts 
+  the PCBs released to it, and each PCB records the count at its release.
+
+  Note that PIDs held in the caches of other cores are not available to
+  a core, so the table may appear full slightly before MAX_PROC processes.
+*/
+#define PID_BATCH 16
+#define PID_REUSE_DELAY 128
 
-void initialize_processes()
+typedef struct pid_cache {
+  PCB* free[PID_BATCH];      /* PCBs to acquire, from free[next] to free[count-1] */
+  int next, count;
+  PCB* released[PID_BATCH];  /* Released PCBs, to return to the pool */
+  int nreleased;
+} pid_cache;
+
+static pid_cache PID_CACHE[MAX_CORES];
+
+static PCB* pid_pool_head;
+static PCB* pid_pool_tail;
+static unsigned long pid_pool_seq;
+static Mutex pid_pool_spinlock = MUTEX_INIT;
+
+/*
+  Allocate the next chunk of the process table, and add its PCBs to the
+  head of the pool, lowest PID first. Return 0 if the table is full.
+
+  Must be called with pid_pool_spinlock held
+*/
+static int allocate_PT_chunk()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
-  }
+  if(pt_chunks == PT_CHUNKS) return 0;
+
+  Pid_t base = pt_chunks << PT_CHUNK_BITS;
+  PCB* chunk = (PCB*) xmalloc(PT_CHUNK_SIZE * sizeof(PCB));
+
+  /* The last chunk may be partly beyond MAX_PROC */
+  int size = (MAX_PROC - base < PT_CHUNK_SIZE) ? MAX_PROC - base : PT_CHUNK_SIZE;
+
+  if(pid_pool_head == NULL)
+    pid_pool_tail = &chunk[size-1];
 
   /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
+  for(int i=size-1; i>=0; i--) {
+    initialize_PCB(&chunk[i], base+i);
+    chunk[i].free_seq = 0;   /* never used, so it is not delayed */
+    chunk[i].parent = pid_pool_head;
+    pid_pool_head = &chunk[i];
+  }
+
+  /* Publish the chunk to get_pcb() */
+  __atomic_store_n(& PT[pt_chunks], chunk, __ATOMIC_RELEASE);
+  pt_chunks++;
+  return 1;
+}
+
+/* Refill the cache of a core from the pool */
+static void pid_cache_refill(pid_cache* pc)
+{
+  Mutex_Lock(& pid_pool_spinlock);
+
+  pc->next = pc->count = 0;
+  while(pc->count < PID_BATCH) {
+    PCB* pcb = pid_pool_head;
+
+    if(pcb == NULL || pid_pool_seq - pcb->free_seq < PID_REUSE_DELAY) {
+      /* Grow the table, rather than reuse a recent PID */
+      if(allocate_PT_chunk()) continue;
+      if(pcb == NULL) break;
+    }
+
+    pid_pool_head = pcb->parent;
+    if(pid_pool_head == NULL) pid_pool_tail = NULL;
+    pc->free[pc->count++] = pcb;
+  }
+
+  Mutex_Unlock(& pid_pool_spinlock);
+}
+
+/* Return the released PCBs of a core to the tail of the pool */
+static void pid_cache_flush(pid_cache* pc)
+{
+  Mutex_Lock(& pid_pool_spinlock);
+
+  for(int i=0; i<pc->nreleased; i++) {
+    PCB* pcb = pc->released[i];
+    pcb->free_seq = pid_pool_seq++;
+    pcb->parent = NULL;
+    if(pid_pool_tail == NULL)
+      pid_pool_head = pcb;
+    else
+      pid_pool_tail->parent = pcb;
+    pid_pool_tail = pcb;
+  }
+  pc->nreleased = 0;
+
+  Mutex_Unlock(& pid_pool_spinlock);
+}
+
+void initialize_processes()
+{
+  /* The chunks of the process table are allocated on demand */
+  for(unsigned int c=0; c<PT_CHUNKS; c++)
+    PT[c] = NULL;
+  pt_chunks = 0;
+
+  for(unsigned int w=0; w<PT_MAP_WORDS; w++)
+    pt_occupied[w] = 0;
+
+  pid_pool_head = pid_pool_tail = NULL;
+  pid_pool_seq = PID_REUSE_DELAY;
+  for(int c=0; c<MAX_CORES; c++) {
+    PID_CACHE[c].next = PID_CACHE[c].count = 0;
+    PID_CACHE[c].nreleased = 0;
   }
 
   process_count = 0;
@@ -79,32 +264,86 @@ void initialize_processes()
 }
 
 
+/* Return the pid of the next generation of the same slot */
+static inline Pid_t next_generation(Pid_t pid)
+{
+  Pid_t gen = ((pid >> PID_SLOT_BITS) + 1) & (PID_GENERATIONS - 1);
+  return (gen << PID_SLOT_BITS) | PID_SLOT(pid);
+}
+
 /*
-  Must be called with kernel_mutex held
+  Acquire up to n free PCBs, and return how many were acquired.
+
+  This is called with the kernel lock held.
 */
-PCB* acquire_PCB()
+static int acquire_PCBs(PCB** pcbs, int n)
 {
-  PCB* pcb = NULL;
+  int i = 0;
+
+  int preempt = preempt_off;
+  pid_cache* pc = & PID_CACHE[cpu_core_id];
+
+  while(i < n) {
+    if(pc->next == pc->count) {
+      pid_cache_refill(pc);
+      if(pc->count == 0) break;   /* no free PCBs */
+    }
+
+    PCB* pcb = pc->free[pc->next++];
+
+    /* After many generations, the pid may still be held by a zombie */
+    while(get_zombie(pcb->pid) != NULL)
+      pcb->pid = next_generation(pcb->pid);
 
-  if(pcb_freelist != NULL) {
-    pcb = pcb_freelist;
     pcb->pstate = ALIVE;
-    pcb_freelist = pcb_freelist->parent;
-    process_count++;
+    memset(& pcb->usage, 0, sizeof(proc_usage));
+    pcb->autoreap = 0;
+    pt_occupied_set(PID_SLOT(pcb->pid));
+    pcbs[i++] = pcb;
   }
 
-  return pcb;
+  __atomic_fetch_add(& process_count, i, __ATOMIC_RELAXED);
+
+  if(preempt) preempt_on;
+  return i;
 }
 
 /*
-  Must be called with kernel_mutex held
+  Acquire a free PCB, or return NULL if there is none.
+*/
+PCB* acquire_PCB()
+{
+  PCB* pcb;
+  return acquire_PCBs(&pcb, 1) ? pcb : NULL;
+}
+
+/*
+  Release a PCB, advancing the generation of its PID.
+
+  This is called without the kernel lock, after the last thread of the
+  process has switched out. The slot stays occupied while it holds zombie
+  records; the fence pairs with the one in cleanup_zombie(), so that one
+  of us sees the slot empty.
 */
 void release_PCB(PCB* pcb)
 {
-  pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
-  process_count--;
+  int preempt = preempt_off;
+  pid_cache* pc = & PID_CACHE[cpu_core_id];
+
+  __atomic_store_n(& pcb->pstate, FREE, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(& pcb->zombies.next, __ATOMIC_RELAXED) == & pcb->zombies)
+    pt_occupied_clear(PID_SLOT(pcb->pid));
+
+  pcb->pid = next_generation(pcb->pid);
+
+  pc->released[pc->nreleased++] = pcb;
+  if(pc->nreleased == PID_BATCH)
+    pid_cache_flush(pc);
+
+  __atomic_fetch_sub(& process_count, 1, __ATOMIC_RELAXED);
+
+  if(preempt) preempt_on;
 }
 
 
@@ -114,6 +353,85 @@ void release_PCB(PCB* pcb)
  *
  */
 
+/*
+  Argument buffers.
+
+  Exec copies the arguments into a private buffer of the new process,
+  since the process may write to its arguments. ExecMany copies them once
+  into a buffer shared by all its new processes. The data of a shared
+  buffer is mapped read-only, so that a process which writes to its 
+  arguments faults, instead of changing the arguments of its siblings.
+
+  A shared buffer is passed on without copying: when the arguments of
+  Exec or ExecMany lie in the shared buffer of the calling process, the
+  new processes share that buffer too. Thus, a process created by ExecMany
+  can pass (part of) its arguments to its own children for free.
+*/
+
+static ArgBuf* argbuf_create(int argl, void* args)
+{
+  ArgBuf* ab = (ArgBuf*) xmalloc(sizeof(ArgBuf) + argl);
+  ab->refcount = 1;
+  ab->argl = argl;
+  ab->shared = 0;
+  ab->data = (char*)(ab + 1);
+  memcpy(ab->data, args, argl);
+  return ab;
+}
+
+static ArgBuf* argbuf_create_shared(int argl, void* args)
+{
+  if(argl <= 0)
+    return argbuf_create(argl, args);  /* nothing to protect */
+
+  ArgBuf* ab = (ArgBuf*) xmalloc(sizeof(ArgBuf));
+  ab->refcount = 1;
+  ab->argl = argl;
+  ab->shared = 1;
+
+  void* data = mmap(NULL, argl, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  CHECK((data == MAP_FAILED) ? -1 : 0);
+  memcpy(data, args, argl);
+  CHECK(mprotect(data, argl, PROT_READ));
+  ab->data = data;
+
+  return ab;
+}
+
+static inline ArgBuf* argbuf_incref(ArgBuf* ab)
+{
+  __atomic_fetch_add(& ab->refcount, 1, __ATOMIC_RELAXED);
+  return ab;
+}
+
+/* 
+  Return a new reference to the shared buffer of a process, if it holds
+  the given arguments, else NULL.
+ */
+static ArgBuf* argbuf_share(PCB* pcb, int argl, void* args)
+{
+  ArgBuf* ab = (pcb == NULL) ? NULL : pcb->argbuf;
+  if(ab == NULL || !ab->shared || argl < 0)
+    return NULL;
+
+  char* p = args;
+  if(p < ab->data || p + argl > ab->data + ab->argl)
+    return NULL;
+
+  return argbuf_incref(ab);
+}
+
+void argbuf_decref(ArgBuf* ab)
+{
+  if(ab == NULL || __atomic_sub_fetch(& ab->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  if(ab->shared)
+    CHECK(munmap(ab->data, ab->argl));
+  free(ab);
+}
+
+
 /*
 	This function is provided as an argument to spawn,
 	to execute the main thread of a process.
@@ -131,18 +449,39 @@ void start_main_thread()
 }
 
 
+/* Inherit the file streams of the parent */
+static void inherit_streams(PCB* newproc, PCB* parent)
+{
+  for(int i=0; i<MAX_FILEID; i++) {
+     newproc->FIDT[i] = parent->FIDT[i];
+     if(newproc->FIDT[i])
+        FCB_incref(newproc->FIDT[i]);
+  }
+}
+
+
 /*
-	System call to create a new process.
+	System call to create a new process, with a given main thread stack size.
  */
-Pid_t sys_Exec(Task call, int argl, void* args)
+Pid_t sys_ExecStack(Task call, int argl, void* args, unsigned int stack_size)
 {
-  PCB *curproc, *newproc;
+  PCB *curproc = NULL, *newproc;
   
   /* The new process PCB */
   newproc = acquire_PCB();
 
   if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
 
+  /* The thread for the main function; it may fail for a bad stack size */
+  if(call != NULL) {
+    newproc->main_thread = spawn_thread_stack(newproc, start_main_thread, stack_size);
+    if(newproc->main_thread == NULL) {
+      release_PCB(newproc);
+      newproc = NULL;
+      goto finish;
+    }
+  }
+
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
@@ -158,35 +497,39 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    inherit_streams(newproc, curproc);
+
+    /* Join the process group of the parent */
+    newproc->group = curproc->group;
+    group_incref(newproc->group);
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
 
-  /* Copy the arguments to new storage, owned by the new process */
+  /* Share the arguments, or copy them into an argument buffer held by the new process */
   newproc->argl = argl;
-  if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
+  if(args!=NULL && (newproc->argbuf = argbuf_share(curproc, argl, args)) != NULL) {
+    newproc->args = args;
   }
-  else
+  else if(args!=NULL) {
+    newproc->argbuf = argbuf_create(argl, args);
+    newproc->args = newproc->argbuf->data;
+  }
+  else {
+    newproc->argbuf = NULL;
     newproc->args=NULL;
+  }
 
   /* 
-    Create and wake up the thread for the main function. This must be the last thing
+    Wake up the thread for the main function. This must be the last thing
     we do, because once we wakeup the new thread it may run! so we need to have finished
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
-    newproc->thread_count++;
-    acquire_ptcb(newproc->main_thread, call, argl, args);
+    account_thread_start(newproc, newproc->main_thread);
+    acquire_ptcb(newproc->main_thread, call, newproc->argl, newproc->args);
     wakeup(newproc->main_thread);
   }
 
@@ -196,6 +539,120 @@ finish:
 }
 
 
+/*
+	System call to create a new process.
+ */
+Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecStack(call, argl, args, 0);
+}
+
+
+/*
+  System call to create many processes. 
+
+  The PCBs and the thread stacks are allocated in batches, the children
+  share one read-only argument buffer, are added to the children list 
+  at once, and are woken up by a single call to the scheduler.
+ */
+int sys_ExecMany(Task call, int count, int argl, void* args, Pid_t* pids_out)
+{
+  if(call == NULL || count <= 0) return -1;
+
+  /* More than the free PCBs is surely an error */
+  if((unsigned int) count > MAX_PROC - __atomic_load_n(& process_count, __ATOMIC_RELAXED))
+    return -1;
+
+  PCB* curproc = CURPROC;
+  PCB** procs = (PCB**) xmalloc(count * sizeof(PCB*));
+  TCB** threads = (TCB**) xmalloc(count * sizeof(TCB*));
+
+  /* We may run out of PIDs, as some may be cached by other cores */
+  int n = acquire_PCBs(procs, count);
+
+  /* We may also run out of memory for the threads */
+  int spawned = spawn_threads(procs, n, start_main_thread, threads);
+  while(n > spawned)
+    release_PCB(procs[--n]);
+
+  ArgBuf* ab = NULL;
+  void* childargs = NULL;
+  if(args != NULL && n > 0) {
+    if((ab = argbuf_share(curproc, argl, args)) != NULL)
+      childargs = args;
+    else {
+      ab = argbuf_create_shared(argl, args);
+      childargs = ab->data;
+    }
+  }
+
+  rlnode children;
+  rlnode_new(& children);
+
+  for(int i = 0; i < n; i++) {
+    PCB* newproc = procs[i];
+
+    assert(get_pid(newproc) > 1);
+    newproc->parent = curproc;
+    rlist_push_front(& children, & newproc->children_node);
+    inherit_streams(newproc, curproc);
+    newproc->group = curproc->group;
+    group_incref(newproc->group);
+
+    newproc->main_task = call;
+    newproc->argl = argl;
+    newproc->args = childargs;
+    newproc->argbuf = (ab == NULL) ? NULL : argbuf_incref(ab);
+  }
+
+  for(int i = 0; i < n; i++) {
+    PCB* newproc = procs[i];
+    newproc->main_thread = threads[i];
+    account_thread_start(newproc, threads[i]);
+    acquire_ptcb(threads[i], call, argl, childargs);
+
+    if(pids_out != NULL) pids_out[i] = get_pid(newproc);
+  }
+
+  if(pids_out != NULL)
+    for(int i = n; i < count; i++) pids_out[i] = NOPROC;
+
+  /* Our own reference */
+  argbuf_decref(ab);
+
+  rlist_prepend(& curproc->children_list, & children);
+
+  /* Start them all */
+  wakeup_many(threads, n);
+  free(threads);
+  free(procs);
+
+  return n;
+}
+
+
+/*
+  System call to set the CPU quota of a process.
+ */
+int sys_SetCPUQuota(Pid_t pid, unsigned long runtime, unsigned long period)
+{
+  PCB* curproc = CURPROC;
+  PCB* pcb = get_pcb(pid);
+
+  if(pcb == NULL || (pcb != curproc && pcb->parent != curproc))
+    return -1;
+  if(runtime > 0 && (period == 0 || runtime > period))
+    return -1;
+
+  /* The process gets its own group, unless it already leads one */
+  if(pcb->group == NULL || pcb->group->leader != pcb)
+    set_process_group(pcb, group_create(pcb));
+
+  group_set_quota(pcb->group, runtime, period);
+  return 0;
+}
+
+
 /* System call */
 Pid_t sys_GetPid()
 {
@@ -209,42 +666,89 @@ Pid_t sys_GetPPid()
 }
 
 
-static void cleanup_zombie(PCB* pcb, int* status)
+/*
+  Zombie records.
+
+  The PCB of an exited process is released as soon as its last thread has
+  switched out; only a Zombie record remains, until the parent reaps it.
+*/
+
+void make_zombie(PCB* pcb)
+{
+  Zombie* z = (Zombie*) xmalloc(sizeof(Zombie));
+  z->pid = pcb->pid;
+  z->exitval = pcb->exitval;
+  z->parent = pcb->parent;
+  z->main_task = pcb->main_task;
+  z->usage = pcb->usage;
+
+  rlnode_init(& z->exited_node, z);
+  rlnode_init(& z->slot_node, z);
+  rlist_push_front(& pcb->parent->exited_list, & z->exited_node);
+  rlist_push_back(& pcb->zombies, & z->slot_node);
+}
+
+void reparent_zombies(PCB* pcb, PCB* newparent)
+{
+  if(is_rlist_empty(& pcb->exited_list)) return;
+
+  for(rlnode* p = pcb->exited_list.next; p != & pcb->exited_list; p = p->next)
+    ((Zombie*) p->obj)->parent = newparent;
+
+  rlist_append(& newparent->exited_list, & pcb->exited_list);
+  kernel_broadcast(& newparent->child_exit);
+}
+
+/*
+  Reap a zombie. The slot of its PCB is marked free if the PCB is already
+  released and holds no other zombies; the fence pairs with the one in 
+  release_PCB().
+*/
+static void cleanup_zombie(Zombie* z, int* status)
 {
   if(status != NULL)
-    *status = pcb->exitval;
+    *status = z->exitval;
+
+  PCB* parent = z->parent;
+  PCB* pcb = pt_slot(PID_SLOT(z->pid));
+
+  rlist_remove(& z->exited_node);
+  rlist_remove(& z->slot_node);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(is_rlist_empty(& pcb->zombies) && __atomic_load_n(& pcb->pstate, __ATOMIC_RELAXED) == FREE)
+    pt_occupied_clear(PID_SLOT(z->pid));
 
-  rlist_remove(& pcb->children_node);
-  rlist_remove(& pcb->exited_node);
+  /* Waiters for any child must return, if there are no more children */
+  if(is_rlist_empty(& parent->children_list) && is_rlist_empty(& parent->exited_list))
+    kernel_broadcast(& parent->child_exit);
 
-  release_PCB(pcb);
+  free(z);
 }
 
 
 static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 {
-
-  /* Legality checks */
-  if((cpid<0) || (cpid>=MAX_PROC)) {
-    cpid = NOPROC;
-    goto finish;
-  }
-
   PCB* parent = CURPROC;
   PCB* child = get_pcb(cpid);
-  if( child == NULL || child->parent != parent)
-  {
-    cpid = NOPROC;
-    goto finish;
-  }
+  if(child != NULL && child->parent != parent)
+    return NOPROC;
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
-  while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
-  
-  cleanup_zombie(child, status);
-  
-finish:
+  while(child != NULL) {
+    kernel_wait(& child->exit_cv, SCHED_USER);
+
+    /* Once it has exited, its PCB may be released, or even hold a new process */
+    if(! pcb_valid(child, cpid))
+      child = NULL;
+  }
+
+  /* Another thread may have reaped it, while we were waking up */
+  Zombie* z = get_zombie(cpid);
+  if(z == NULL || z->parent != parent)
+    return NOPROC;
+
+  cleanup_zombie(z, status);
   return cpid;
 }
 
@@ -256,23 +760,15 @@ static Pid_t wait_for_any_child(int* status)
   PCB* parent = CURPROC;
 
   /* Make sure I have children! */
-  int no_children, has_exited;
-  while(1) {
-    no_children = is_rlist_empty(& parent->children_list);
-    if( no_children ) break;
-
-    has_exited = ! is_rlist_empty(& parent->exited_list);
-    if( has_exited ) break;
+  while(is_rlist_empty(& parent->exited_list)) {
+    if(is_rlist_empty(& parent->children_list))
+      return NOPROC;
 
     kernel_wait(& parent->child_exit, SCHED_USER);    
   }
 
-  if(no_children)
-    return NOPROC;
-
-  PCB* child = parent->exited_list.next->pcb;
-  assert(child->pstate == ZOMBIE);
-  cpid = get_pid(child);
+  Zombie* child = parent->exited_list.next->obj;
+  cpid = child->pid;
   cleanup_zombie(child, status);
 
   return cpid;
@@ -293,6 +789,26 @@ Pid_t sys_WaitChild(Pid_t cpid, int* status)
 }
 
 
+/*
+  System call to enable automatic reaping of the children of the current
+  process. The current zombie children are reaped at once.
+ */
+int sys_SetAutoReap(int on)
+{
+  PCB* curproc = CURPROC;
+  int old = curproc->autoreap;
+
+  curproc->autoreap = (on != 0);
+
+  if(on) {
+    while(! is_rlist_empty(& curproc->exited_list))
+      cleanup_zombie(curproc->exited_list.next->obj, NULL);
+  }
+
+  return old;
+}
+
+
 void sys_Exit(int exitval)
 {
 
@@ -315,9 +831,352 @@ void sys_Exit(int exitval)
 }
 
 
+/*
+  Process handles.
+
+  A process handle is a stream that becomes readable when a child process
+  exits. It is registered in the exit_handles list of the child, and the 
+  exit status is stored in it when the child exits, so that it is kept
+  even if the child is reaped by WaitChild.
+
+  The first Read returns the exit status (an int) and, if the reader is the
+  parent, also reaps the child. Subsequent reads return 0 (end of file).
+
+  A thread in WaitHandles waits at a condition variable of its own, which
+  is registered at each of the handles it waits for, through a node in 
+  their waiters list.
+*/
+typedef struct process_handle {
+  Pid_t pid;         /* The pid of the child process */
+  int exited;        /* Non-zero after the child exits */
+  int exitval;       /* The exit status of the child */
+  int consumed;      /* Non-zero after the exit status was read */
+  CondVar exit_cv;   /* Broadcast when the child exits */
+  rlnode exit_node;  /* Node in the exit_handles list of the child */
+  rlnode waiters;    /* Nodes of the CondVars of threads in WaitHandles */
+} process_handle;
+
+/* Wake up the threads waiting for the handle, in Read and WaitHandles */
+static void wake_handle_waiters(process_handle* ph)
+{
+  kernel_broadcast(& ph->exit_cv);
+  for(rlnode* p = ph->waiters.next; p != & ph->waiters; p = p->next)
+    kernel_broadcast((CondVar*) p->obj);
+}
+
+void notify_exit_handles(PCB* pcb)
+{
+  while(! is_rlist_empty(& pcb->exit_handles)) {
+    process_handle* ph = rlist_pop_front(& pcb->exit_handles)->obj;
+    ph->exitval = pcb->exitval;
+    ph->exited = 1;
+    wake_handle_waiters(ph);
+  }
+}
+
+static int process_handle_read(void* this, char* buf, unsigned int size)
+{
+  process_handle* ph = this;
+
+  if(size < sizeof(int)) return -1;
+
+  while(! ph->exited)
+    kernel_wait(& ph->exit_cv, SCHED_USER);
+
+  if(ph->consumed) return 0;
+  ph->consumed = 1;
+
+  memcpy(buf, & ph->exitval, sizeof(int));
+  account_io(sizeof(int), 0);
+
+  /* Reap the child, unless some other thread has done so */
+  Zombie* child = get_zombie(ph->pid);
+  if(child != NULL && child->parent == CURPROC)
+    cleanup_zombie(child, NULL);
+
+  return sizeof(int);
+}
+
+static int process_handle_write(void* this __attribute__((unused)), 
+  const char* buf __attribute__((unused)), unsigned int size __attribute__((unused)))
+{
+  return -1;
+}
+
+static int process_handle_close(void* this)
+{
+  process_handle* ph = this;
+
+  if(! ph->exited)
+    rlist_remove(& ph->exit_node);
+
+  /* Threads in WaitHandles will find that the handle is closed */
+  wake_handle_waiters(ph);
+  while(! is_rlist_empty(& ph->waiters))
+    rlist_pop_front(& ph->waiters);
+
+  free(ph);
+  return 0;
+}
+
+static file_ops process_handle_ops = {
+  .Open = NULL,
+  .Read = process_handle_read,
+  .Write = process_handle_write,
+  .Close = process_handle_close
+};
+
+
+Fid_t sys_OpenChild(Pid_t pid)
+{
+  /* The child may be alive, or a zombie */
+  PCB* child = get_pcb(pid);
+  Zombie* zombie = NULL;
+  if(child == NULL) {
+    zombie = get_zombie(pid);
+    if(zombie == NULL || zombie->parent != CURPROC)
+      return NOFILE;
+  }
+  else if(child->parent != CURPROC)
+    return NOFILE;
+
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  process_handle* ph = (process_handle*) xmalloc(sizeof(process_handle));
+  ph->pid = pid;
+  ph->exited = 0;
+  ph->consumed = 0;
+  ph->exit_cv = COND_INIT;
+  rlnode_init(& ph->exit_node, ph);
+  rlnode_init(& ph->waiters, NULL);
+
+  if(zombie != NULL) {
+    ph->exitval = zombie->exitval;
+    ph->exited = 1;
+  } 
+  else 
+    rlist_push_back(& child->exit_handles, & ph->exit_node);
+
+  fcb->streamobj = ph;
+  fcb->streamfunc = & process_handle_ops;
+
+  return fid;
+}
+
+
+/* Return the process handle of a file id, or NULL if it is not one */
+static process_handle* get_process_handle(Fid_t fid)
+{
+  FCB* fcb = get_fcb(fid);
+  return (fcb != NULL && fcb->streamfunc == & process_handle_ops) ? fcb->streamobj : NULL;
+}
+
+int sys_WaitHandles(const Fid_t* fids, int n)
+{
+  if(fids == NULL || n <= 0 || n > MAX_FILEID)
+    return -1;
+
+  CondVar cv = COND_INIT;
+  rlnode nodes[MAX_FILEID];
+
+  while(1) {
+    /* Look for a readable handle, checking that all are still open */
+    for(int i = 0; i < n; i++) {
+      process_handle* ph = get_process_handle(fids[i]);
+      if(ph == NULL) return -1;
+      if(ph->exited) return i;
+    }
+
+    for(int i = 0; i < n; i++) {
+      rlnode_init(& nodes[i], & cv);
+      rlist_push_back(& get_process_handle(fids[i])->waiters, & nodes[i]);
+    }
+
+    kernel_wait(& cv, SCHED_USER);
+
+    /* Nodes of closed handles have already been removed */
+    for(int i = 0; i < n; i++)
+      rlist_remove(& nodes[i]);
+  }
+}
+
+
+/*
+  Resource accounting.
+
+  The counters that change at every context switch or stream operation
+  are kept in the TCB, and are only updated on the core running the thread.
+  They are merged into the PCB when the thread exits. The other counters
+  change on thread creation and exit, and are kept in the PCB.
+*/
+
+void account_thread_start(PCB* pcb, TCB* tcb)
+{
+  pcb->thread_count++;
+  pcb->usage.threads_created++;
+  if(pcb->thread_count > pcb->usage.peak_threads)
+    pcb->usage.peak_threads = pcb->thread_count;
+  pcb->usage.stack_bytes += tcb->stack_size;
+}
+
+void account_thread_exit(PCB* pcb, TCB* tcb)
+{
+  /* We are still running; the scheduler must not update the counters meanwhile */
+  int preempt = preempt_off;
+  TimerDuration now = bios_clock();
+  tcb->cpu_time += now - tcb->run_start;
+  tcb->run_start = now;
+
+  pcb->usage.cpu_time += tcb->cpu_time;
+  pcb->usage.ctx_switches += tcb->ctx_switches;
+  if(preempt) preempt_on;
+
+  pcb->usage.bytes_read += tcb->bytes_read;
+  pcb->usage.bytes_written += tcb->bytes_written;
+
+  pcb->usage.stack_bytes -= tcb->stack_size;
+
+  pcb->thread_count--;
+}
+
+void get_proc_usage(PCB* pcb, proc_usage* usage)
+{
+  *usage = pcb->usage;
+
+  /* Add the live threads */
+  for(rlnode* p = pcb->ptcb_list.next; p != & pcb->ptcb_list; p = p->next) {
+    PTCB* ptcb = p->ptcb;
+    if(ptcb->exited || ptcb->tcb == NULL) continue;
+
+    TCB* tcb = ptcb->tcb;
+    usage->cpu_time += tcb->cpu_time;
+    usage->ctx_switches += tcb->ctx_switches;
+    usage->bytes_read += tcb->bytes_read;
+    usage->bytes_written += tcb->bytes_written;
+  }
+}
+
+
+/*
+  Information streams.
+
+  An information stream is a cursor over the process table. Each Read
+  returns as many procinfo records as fit in the buffer, for the next
+  slots in use, found through the occupancy bitmap. A slot holds at most
+  one live process, and the zombie records of earlier processes in its
+  PCB. The kernel lock is only held for the duration of each Read, so the
+  table may change between reads; a process is reported at most once, if
+  it is in its slot when the cursor passes it.
+*/
+typedef struct info_cursor {
+  unsigned int next;    /* The next process table slot to examine */
+} info_cursor;
+
+static void fill_procinfo(procinfo* info, PCB* pcb)
+{
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->alive = (pcb->pstate == ALIVE);
+  info->thread_count = pcb->thread_count;
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+  get_proc_usage(pcb, & info->usage);
+
+  int len = (pcb->argl < PROCINFO_MAX_ARGS_SIZE) ? pcb->argl : PROCINFO_MAX_ARGS_SIZE;
+  if(pcb->args != NULL && len > 0)
+    memcpy(info->args, pcb->args, len);
+}
+
+/* The arguments of a zombie are not kept */
+static void fill_zombie_procinfo(procinfo* info, Zombie* z)
+{
+  info->pid = z->pid;
+  info->ppid = get_pid(z->parent);
+  info->alive = 0;
+  info->thread_count = 0;
+  info->main_task = z->main_task;
+  info->argl = 0;
+  info->usage = z->usage;
+}
+
+static int info_read(void* this, char* buf, unsigned int size)
+{
+  info_cursor* cur = this;
+  unsigned int count = 0;
+
+  if(size < sizeof(procinfo)) return -1;
+
+  while(size - count >= sizeof(procinfo)) {
+    unsigned int slot = pt_next_occupied(cur->next);
+    if(slot >= MAX_PROC) break;
+
+    /* An occupied slot is in an allocated chunk */
+    PCB* pcb = pt_slot(slot);
+    int alive = (pcb->pstate == ALIVE);
+    unsigned int n = alive + rlist_len(& pcb->zombies);
+
+    /* Do not split a slot across reads, unless it does not fit in the buffer */
+    if(count > 0 && size - count < n * sizeof(procinfo)) break;
+    cur->next = slot + 1;
+
+    procinfo info;
+    if(alive) {
+      memset(&info, 0, sizeof(info));
+      fill_procinfo(&info, pcb);
+      memcpy(buf + count, &info, sizeof(info));
+      count += sizeof(procinfo);
+    }
+
+    for(rlnode* p = pcb->zombies.next; 
+        p != & pcb->zombies && size - count >= sizeof(procinfo); p = p->next) {
+      memset(&info, 0, sizeof(info));
+      fill_zombie_procinfo(&info, p->obj);
+      memcpy(buf + count, &info, sizeof(info));
+      count += sizeof(procinfo);
+    }
+  }
+
+  account_io(count, 0);
+  return count;
+}
+
+static int info_write(void* this __attribute__((unused)), 
+  const char* buf __attribute__((unused)), unsigned int size __attribute__((unused)))
+{
+  return -1;
+}
+
+static int info_close(void* this)
+{
+  free(this);
+  return 0;
+}
+
+static file_ops info_ops = {
+  .Open = NULL,
+  .Read = info_read,
+  .Write = info_write,
+  .Close = info_close
+};
+
+
 Fid_t sys_OpenInfo()
 {
-	return NOFILE;
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  info_cursor* cur = (info_cursor*) xmalloc(sizeof(info_cursor));
+  cur->next = 0;
+
+  fcb->streamobj = cur;
+  fcb->streamfunc = & info_ops;
+
+  return fid;
 }
 
 
@@ -21,22 +21,51 @@
 /**
   @brief PID state
 
-  A PID can be either free (no process is using it), ALIVE (some running process is
-  using it), or ZOMBIE (a zombie process is using it).
+  A PCB can be either free (no process is using it), ALIVE (some running process is
+  using it), or ZOMBIE (its process has exited, but its last thread has not yet
+  switched out). The exit status of a zombie process is not kept in its PCB,
+  but in a @c Zombie record.
   */
 typedef enum pid_state_e {
   FREE,   /**< @brief The PID is free and available */
   ALIVE,  /**< @brief The PID is given to a process */
-  ZOMBIE  /**< @brief The PID is held by a zombie */
+  ZOMBIE  /**< @brief The process has exited, and the PCB is about to be released */
 } pid_state;
 
+/**
+  @brief Argument buffer.
+
+  A reference-counted copy of the arguments of a process. A buffer 
+  created by @c Exec is private to the new process, which may write to it.
+  A buffer created by @c ExecMany is shared by all the new processes, and
+  its data is mapped read-only, so that no process can change the 
+  arguments of the others. Such a buffer is also shared with the children
+  of these processes, when they pass on (part of) their arguments.
+  */
+typedef struct argument_buffer {
+  int refcount;           /**< @brief Number of holders of the buffer */
+  int argl;               /**< @brief The length of the arguments */
+  int shared;             /**< @brief Non-zero if @c data is a read-only mapping */
+  char* data;             /**< @brief The arguments */
+} ArgBuf;
+
+/**
+  @brief Release a reference to an argument buffer.
+
+  The buffer is freed when the last reference is released.
+  @param ab the buffer, which may be NULL
+  */
+void argbuf_decref(ArgBuf* ab);
+
 /**
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
  */
 typedef struct process_control_block {
+  Pid_t pid;              /**< @brief The pid of this PCB, whose generation advances when it is released */
   pid_state  pstate;      /**< @brief The pid state for this PCB */
+  unsigned long free_seq; /**< @brief PID pool release count when this PCB was last released */
 
   PCB* parent;            /**< @brief Parent's pcb. */
   int exitval;            /**< @brief The exit value of the process */
@@ -45,32 +74,193 @@ typedef struct process_control_block {
   Task main_task;         /**< @brief The main thread's function */
   int argl;               /**< @brief The main thread's argument length */
   void* args;             /**< @brief The main thread's argument string */
+  ArgBuf* argbuf;         /**< @brief The argument buffer holding @c args */
 
-  rlnode children_list;   /**< @brief List of children */
-  rlnode exited_list;     /**< @brief List of exited children */
+  rlnode children_list;   /**< @brief List of live children */
+  rlnode exited_list;     /**< @brief List of the @c Zombie records of exited children */
 
   rlnode children_node;   /**< @brief Intrusive node for @c children_list */
-  rlnode exited_node;     /**< @brief Intrusive node for @c exited_list */
 
-  CondVar child_exit;     /**< @brief Condition variable for @c WaitChild. 
+  rlnode zombies;         /**< @brief The @c Zombie records of earlier processes in this PCB.
+
+                             This list belongs to the process table slot, and it is
+                             kept when the PCB is released and reused. */
+
+  CondVar child_exit;     /**< @brief Condition variable for @c WaitChild on any child. 
 
-                             This condition variable is  broadcast each time a child
-                             process terminates. It is used in the implementation of
-                             @c WaitChild() */
+                             This condition variable is signalled each time a child
+                             process terminates, and broadcast when the last child
+                             is reaped. It is used in the implementation of
+                             @c WaitChild(NOPROC,...) */
+
+  CondVar exit_cv;        /**< @brief Condition variable for @c WaitChild on this process.
+
+                             This condition variable is broadcast when this process
+                             terminates. */
+
+  rlnode exit_handles;    /**< @brief Open process handles of this process, see @c OpenChild */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
 
   rlnode ptcb_list;
-  int thread_count;
+  unsigned long thread_count;
+
+  proc_usage usage;       /**< @brief Resource usage, excluding the CPU, switches and I/O of live threads */
+
+  PGRP* group;            /**< @brief The process group, or NULL */
+
+  int autoreap;           /**< @brief Non-zero if exited children are released at once, see @c SetAutoReap */
 
 } PCB;
 
+/**
+  @brief Zombie record.
+
+  When a process exits, its PCB is released, as soon as its last thread has
+  switched out. What its parent may still ask for, until it reaps the 
+  process, is kept in this small record. The record is in the exited list
+  of the parent, and in the zombie list of the PCB slot of the process, 
+  so that it is found by its pid.
+  */
+typedef struct zombie_record {
+  Pid_t pid;              /**< @brief The pid of the exited process */
+  int exitval;            /**< @brief The exit value of the process */
+  PCB* parent;            /**< @brief The parent, which will reap the record */
+  Task main_task;         /**< @brief The main thread's function */
+  proc_usage usage;       /**< @brief The final resource usage of the process */
+
+  rlnode exited_node;     /**< @brief Intrusive node for the @c exited_list of the parent */
+  rlnode slot_node;       /**< @brief Intrusive node for the @c zombies list of the PCB */
+} Zombie;
+
+/**
+  @brief Turn an exiting process into a zombie.
+
+  A @c Zombie record is created with the exit status and the resource 
+  usage of the process, and it is added to the exited list of its parent.
+  This is called by the last thread of the process, after it has left
+  the children list of its parent.
+  @param pcb the exiting process
+  */
+void make_zombie(PCB* pcb);
+
+/**
+  @brief Move the zombie children of a process to another process.
+  @param pcb the process
+  @param newparent the new parent of the zombies
+  */
+void reparent_zombies(PCB* pcb, PCB* newparent);
+
+/**
+  @brief Get the zombie record of a pid.
+
+  @param pid the pid of an exited process
+  @returns the zombie record, or NULL if @c pid is not a zombie (e.g., it
+    is alive, it has been reaped, or it is stale)
+  */
+Zombie* get_zombie(Pid_t pid);
+
+/**
+  @brief Notify the process handles of an exiting process.
+
+  This is called when the process terminates, after @c exitval is set.
+  @param pcb the exiting process
+  */
+void notify_exit_handles(PCB* pcb);
+
+/**
+  @brief Account a new thread of a process.
+
+  This increases the thread count of the process, and must be called
+  for every new thread.
+  @param pcb the process
+  @param tcb the new thread
+  */
+void account_thread_start(PCB* pcb, TCB* tcb);
+
+/**
+  @brief Account an exiting thread of a process.
+
+  The usage counters of the thread are merged into the process. This
+  decreases the thread count of the process, and must be called by
+  every exiting thread.
+  @param pcb the process
+  @param tcb the current thread
+  */
+void account_thread_exit(PCB* pcb, TCB* tcb);
+
+/**
+  @brief Return the resource usage of a process.
+
+  The counters of the live threads are added to those of the process.
+  @param pcb the process
+  @param usage the returned resource usage
+  */
+void get_proc_usage(PCB* pcb, proc_usage* usage);
+
+/**
+  @brief Account stream I/O of the current thread.
+
+  This is called by the Read and Write operations of every stream type,
+  with the number of bytes they transferred.
+  @param nread bytes read
+  @param nwritten bytes written
+  */
+static inline void account_io(unsigned long nread, unsigned long nwritten)
+{
+  TCB* tcb = cur_thread();
+  tcb->bytes_read += nread;
+  tcb->bytes_written += nwritten;
+}
+
+/**
+  @brief Release a PCB.
+
+  The PID of the process becomes free. This is called when the last
+  thread of an exited process has switched out, and the PCB is no longer
+  in use. The zombie record of the process, if any, is kept.
+  @param pcb the process
+  */
+void release_PCB(PCB* pcb);
+
 void acquire_ptcb(TCB* tcb, Task task, int argl, void* args);
 void start_main_ptcb_thread();
 void increase_refcount(PTCB* ptcb);
 void decrease_refcount(PTCB* ptcb);
 
 
+/**
+  @brief Number of PCBs in a process table chunk (log2).
+
+  The process table is a directory of chunks of PCBs, which are allocated
+  when the PCBs already allocated are all in use.
+*/
+#define PT_CHUNK_BITS 8
+
+/** @brief Number of PCBs in a process table chunk */
+#define PT_CHUNK_SIZE (1 << PT_CHUNK_BITS)
+
+/** @brief Number of chunks in the process table directory */
+#define PT_CHUNKS ((MAX_PROC + PT_CHUNK_SIZE - 1) / PT_CHUNK_SIZE)
+
+/**
+  @brief Number of bits of the process table slot in a PID (log2 of @c MAX_PROC).
+
+  The low bits of a PID hold the slot of its PCB in the process table, and 
+  the higher bits hold the generation of the slot. The generation advances
+  every time the PCB is released, so that a stale PID does not denote the
+  next process in the same slot, until the generation wraps around.
+*/
+#define PID_SLOT_BITS 16
+
+_Static_assert(MAX_PROC == (1 << PID_SLOT_BITS), "MAX_PROC must be 2^PID_SLOT_BITS");
+
+/** @brief The process table slot of a PID */
+#define PID_SLOT(pid) ((pid) & (MAX_PROC - 1))
+
+/** @brief Number of PID generations, so that PIDs stay positive */
+#define PID_GENERATIONS (1 << (31 - PID_SLOT_BITS))
+
 /**
   @brief Initialize the process table.
 
@@ -84,13 +274,33 @@ void initialize_processes();
 
   This function will return a pointer to the PCB of 
   the process with a given PID. If the PID does not
-  correspond to a process, the function returns @c NULL.
+  correspond to a live process, the function returns @c NULL.
+  This includes exited processes (see @c get_zombie()), and
+  stale PIDs, whose process has been released.
+  A PCB pointer kept while sleeping must be re-checked with @c pcb_valid().
 
   @param pid the pid of the process 
   @returns A pointer to the PCB of the process, or NULL.
 */
 PCB* get_pcb(Pid_t pid);
 
+/**
+  @brief Check that a PCB pointer still denotes a process.
+
+  A PCB pointer kept while the thread sleeps (e.g., in @c kernel_wait) 
+  may refer to a released PCB when the thread wakes up, or even to a new 
+  process in the same process table slot. Such a pointer must be checked 
+  with this function, before it is used again.
+
+  @param pcb the PCB, as returned by @c get_pcb(pid) before sleeping
+  @param pid the pid of the process
+  @returns 1 if @c pcb is still the PCB of process @c pid, else 0.
+*/
+static inline int pcb_valid(PCB* pcb, Pid_t pid)
+{
+  return pcb != NULL && get_pcb(pid) == pcb;
+}
+
 /**
   @brief Get the PID of a PCB.
 
@@ -15,6 +15,8 @@
 
 int yield_counter;	//every time we yield we add 1
 
+enum PREEMPT_MODE preempt_mode = PREEMPT_SIGNAL;
+
 /********************************************
 	
 	Core table and CCB-related declarations.
@@ -64,6 +66,8 @@ TCB* cur_thread()
   +-------------+
   |   TCB       |
   +-------------+
+  | guard page  |
+  +-------------+
   |             |
   |    stack    |
   |             |
@@ -74,19 +78,34 @@ TCB* cur_thread()
   +-------------+
 
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  crash own thread, at the guard page, before it affects the TCB or other
+  threads (which may make debugging easier).
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
  */
 
 /*
-  A counter for active threads. By "active", we mean 'existing',
+  The count of active threads. By "active", we mean 'existing',
   with the exception of idle threads (they don't count).
+
+  Each core counts the threads spawned and released on it, in two
+  monotonic counters of its CCB, which only the core itself writes.
+  The released counters are read before the spawned counters, so that
+  every release we see has its spawn counted too. Thus, the result may
+  overestimate the count, but it is never 0 while some thread exists.
  */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+unsigned int active_thread_count()
+{
+	unsigned long released = 0, spawned = 0;
+
+	for (uint c = 0; c < cpu_cores(); c++)
+		released += __atomic_load_n(&cctx[c].threads_released, __ATOMIC_ACQUIRE);
+	for (uint c = 0; c < cpu_cores(); c++)
+		spawned += __atomic_load_n(&cctx[c].threads_spawned, __ATOMIC_ACQUIRE);
+
+	return spawned - released;
+}
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -95,42 +114,145 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
-
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. A guard page with PROT_NONE access is placed
+  between the TCB and the stack, so that a stack overflow is detected as a
+  seg.fault, before it corrupts the TCB.
+
+  The stack pages are committed lazily by the OS, as they are touched.
+  Threads of the default stack size are recycled through a small cache. A cached
+  thread keeps its mapping, but its stack pages are returned to the OS with
+  madvise(), so that the resident memory tracks the actual stack use.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+#ifdef MADV_FREE
+#define THREAD_MADV_RECYCLE MADV_FREE
+#else
+#define THREAD_MADV_RECYCLE MADV_DONTNEED
+#endif
+
+/* The maximum number of cached threads */
+#define THREAD_CACHE_SIZE 64
 
-void* allocate_thread(size_t size)
+static void* thread_cache[THREAD_CACHE_SIZE];
+static unsigned int thread_cache_len = 0;
+static Mutex thread_cache_spinlock = MUTEX_INIT;
+
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
+
+void free_thread(void* ptr, size_t stack_size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (stack_size == THREAD_STACK_SIZE) {
+		/* Drop the stack pages, but keep the mapping */
+		CHECK(madvise(ptr + THREAD_TCB_SIZE + THREAD_GUARD_SIZE, stack_size, THREAD_MADV_RECYCLE));
+
+		Mutex_Lock(&thread_cache_spinlock);
+		int cached = thread_cache_len < THREAD_CACHE_SIZE;
+		if (cached)
+			thread_cache[thread_cache_len++] = ptr;
+		Mutex_Unlock(&thread_cache_spinlock);
+
+		if (cached)
+			return;
+	}
+
+	CHECK(munmap(ptr, THREAD_SIZE(stack_size)));
+}
+
+/* Return NULL if the memory cannot be mapped */
+void* allocate_thread(size_t stack_size)
+{
+	void* ptr = NULL;
+
+	if (stack_size == THREAD_STACK_SIZE) {
+		Mutex_Lock(&thread_cache_spinlock);
+		if (thread_cache_len > 0)
+			ptr = thread_cache[--thread_cache_len];
+		Mutex_Unlock(&thread_cache_spinlock);
+
+		if (ptr != NULL)
+			return ptr;
+	}
+
+	ptr = mmap(NULL, THREAD_SIZE(stack_size), PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	/* Protect the guard page */
+	if (mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE) != 0) {
+		CHECK(munmap(ptr, THREAD_SIZE(stack_size)));
+		return NULL;
+	}
 
 	return ptr;
 }
+
+/* Allocate up to n threads, taking the cached ones with one lock, and return how many were allocated */
+int allocate_threads(void** ptrs, int n, size_t stack_size)
+{
+	int i = 0;
+
+	if (stack_size == THREAD_STACK_SIZE) {
+		Mutex_Lock(&thread_cache_spinlock);
+		while (i < n && thread_cache_len > 0)
+			ptrs[i++] = thread_cache[--thread_cache_len];
+		Mutex_Unlock(&thread_cache_spinlock);
+	}
+
+	for (; i < n; i++)
+		if ((ptrs[i] = allocate_thread(stack_size)) == NULL)
+			break;
+	return i;
+}
 #else
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+#define THREAD_GUARD_SIZE 0
 
-void* allocate_thread(size_t size)
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + (stack_size))
+
+void free_thread(void* ptr, size_t stack_size) { free(ptr); }
+
+void* allocate_thread(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	return aligned_alloc(SYSTEM_PAGE_SIZE, THREAD_SIZE(stack_size));
+}
+
+int allocate_threads(void** ptrs, int n, size_t stack_size)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		if ((ptrs[i] = allocate_thread(stack_size)) == NULL)
+			break;
+	return i;
 }
 #endif
 
+/*
+  Return the actual stack size for a requested stack size. A size of 0
+  denotes the default size. The result is a multiple of SYSTEM_PAGE_SIZE,
+  or 0 if the requested size is larger than THREAD_STACK_MAX.
+ */
+static size_t thread_stack_size(size_t stack_size)
+{
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	if (stack_size > THREAD_STACK_MAX)
+		return 0;
+	if (stack_size < THREAD_STACK_MIN)
+		stack_size = THREAD_STACK_MIN;
+
+	return ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+}
+
 
 
 
@@ -142,6 +264,7 @@ void gain(int preempt); /* forward */
 
 static void thread_start()
 {
+	/* We hold the sched_spinlock of the yield() that started us */
 	gain(1);
 	cur_thread()->thread_func();
 
@@ -155,9 +278,15 @@ static void thread_start()
 
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	TCB* tcb = spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+	if (tcb == NULL)
+		FATAL("Cannot allocate the memory of a thread");
+	return tcb;
+}
 
+/* Initialize the TCB of a new thread, with a stack of stack_size bytes */
+static void initialize_thread(TCB* tcb, PCB* pcb, void (*func)(), size_t stack_size)
+{
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
 
@@ -169,6 +298,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->timer_slack = TIMER_SLACK;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
@@ -176,26 +306,62 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
+	tcb->run_start = 0;
+	tcb->cpu_time = 0;
+	tcb->ctx_switches = 0;
+	tcb->bytes_read = 0;
+	tcb->bytes_written = 0;
+	tcb->release_owner = 0;
+
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
+	tcb->stack_size = stack_size;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
+}
+
+/* Increase the count of active threads */
+static void count_spawned_threads(unsigned long n)
+{
+	int preempt = preempt_off;
+	__atomic_store_n(&CURCORE.threads_spawned, CURCORE.threads_spawned + n, __ATOMIC_RELEASE);
+	if (preempt)
+		preempt_on;
+}
 
-	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	stack_size = thread_stack_size(stack_size);
+	if (stack_size == 0)
+		return NULL;
 
+	/* The allocated thread size must be a multiple of page size */
+	TCB* tcb = (TCB*)allocate_thread(stack_size);
+	if (tcb == NULL)
+		return NULL;
+	initialize_thread(tcb, pcb, func, stack_size);
+
+	count_spawned_threads(1);
 	return tcb;
 }
 
+int spawn_threads(PCB** pcbs, int n, void (*func)(), TCB** tcbs)
+{
+	n = allocate_threads((void**)tcbs, n, THREAD_STACK_SIZE);
+	for (int i = 0; i < n; i++)
+		initialize_thread(tcbs[i], pcbs[i], func, THREAD_STACK_SIZE);
+
+	count_spawned_threads(n);
+	return n;
+}
+
 /*
-  This is called with sched_spinlock locked !
+  This is called in the non-preemptive domain, without sched_spinlock !
  */
 void release_TCB(TCB* tcb)
 {
@@ -203,11 +369,28 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	free_thread(tcb, tcb->stack_size);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	/* decrease the count of active threads */
+	__atomic_store_n(&CURCORE.threads_released, CURCORE.threads_released + 1, __ATOMIC_RELEASE);
+}
+
+/*
+  Release all the exited TCBs queued at the current core's reap list.
+
+  The exited threads are queued there by gain(), with sched_spinlock held,
+  and are released here, outside the scheduler's critical section. The
+  last thread of an exited process also releases its PCB here; a zombie
+  record of the process remains until its parent reaps it.
+ */
+static void reap_exited_threads()
+{
+	while (!is_rlist_empty(&CURCORE.reap_list)) {
+		TCB* tcb = rlist_pop_front(&CURCORE.reap_list)->tcb;
+		if (tcb->release_owner)
+			release_PCB(tcb->owner_pcb);
+		release_TCB(tcb);
+	}
 }
 
 /*
@@ -224,18 +407,447 @@ void release_TCB(TCB* tcb)
   The scheduler queue is implemented as a doubly linked list. The
   head and tail of this list are stored in  SCHED.
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+  Also, each core keeps a sorted list of the threads that went to sleep
+  with a timeout on that core, in its CCB. The timeouts of a core are only
+  processed by the ALARM handler of the core, and the core timer is 
+  programmed for the earlier of the end of the quantum and the next expiry.
 
-  Both of these structures are protected by @c sched_spinlock.
+  All of these structures are protected by @c sched_spinlock.
 */
 
 rlnode SCHED[SCHED_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
 Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+unsigned int sched_ready_count; /* The number of threads in the scheduler queue */
+
+
+/*
+  MLFQ feedback.
+
+  At every yield, the priority and the next time slice of the current thread
+  are adjusted by the feedback table, according to the cause of the yield and
+  the cause of the previous one. By default, a thread that keeps exhausting
+  its quantum sinks, with longer slices, and a thread that blocks for I/O 
+  rises. A thread starts at the middle queue and priorities stay within
+  0..SCHED_QUEUES-1, the highest queue being served first.
+
+  The default table can be overridden at boot, by the file named in the
+  TINYOS_MLFQ_TABLE environment variable. Each line of the file is
+	<curr cause> <last cause> <priority change> <slice percent>
+  where a cause is one of QUANTUM, IO, MUTEX, PIPE, POLL, IDLE, USER, or *
+  for any cause, and the slice is a percentage of QUANTUM. Lines starting
+  with # are comments. Later lines override earlier ones.
+*/
+#define SCHED_CAUSES (SCHED_USER + 1)
+
+typedef struct sched_feedback {
+	int priority_delta; /* Added to the priority */
+	unsigned int slice_percent; /* The next time slice, as a percentage of QUANTUM */
+} sched_feedback;
+
+/* The feedback table, indexed by [curr_cause][last_cause] */
+static sched_feedback SCHED_FEEDBACK[SCHED_CAUSES][SCHED_CAUSES];
+
+static const char* sched_cause_names[SCHED_CAUSES] = {
+	"QUANTUM", "IO", "MUTEX", "PIPE", "POLL", "IDLE", "USER"
+};
+
+/* Set the feedback for a pair of causes, where -1 stands for any cause */
+static void sched_feedback_set(int curr, int last, int delta, unsigned int slice)
+{
+	for (int c = 0; c < SCHED_CAUSES; c++)
+		for (int l = 0; l < SCHED_CAUSES; l++)
+			if ((curr < 0 || c == curr) && (last < 0 || l == last)) {
+				SCHED_FEEDBACK[c][l].priority_delta = delta;
+				SCHED_FEEDBACK[c][l].slice_percent = slice;
+			}
+}
+
+static void sched_feedback_defaults()
+{
+	sched_feedback_set(-1, -1, 0, 100);
+	sched_feedback_set(SCHED_QUANTUM, -1, -1, 100);
+	sched_feedback_set(SCHED_QUANTUM, SCHED_QUANTUM, -1, 150);
+	sched_feedback_set(SCHED_IO, -1, +1, 100);
+	sched_feedback_set(SCHED_IO, SCHED_IO, +2, 100);
+	sched_feedback_set(SCHED_PIPE, -1, +1, 100);
+	sched_feedback_set(SCHED_POLL, -1, +1, 100);
+}
+
+/* Return a cause by name, -1 for "*", or -2 if unknown */
+static int sched_cause_parse(const char* name)
+{
+	if (strcmp(name, "*") == 0)
+		return -1;
+	for (int c = 0; c < SCHED_CAUSES; c++)
+		if (strcmp(name, sched_cause_names[c]) == 0)
+			return c;
+	return -2;
+}
+
+static void sched_feedback_load(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL) FATALERR(errno);
+
+	char line[128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char curr[16], last[16], extra[2];
+		int delta;
+		unsigned int slice;
+
+		if (strchr(line, '\n') == NULL && !feof(f))
+			FATAL("Line too long in the MLFQ feedback table");
+
+		if (line[0] == '#')
+			continue;
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+		int n = sscanf(line, "%15s %15s %d %u %1s", curr, last, &delta, &slice, extra);
+		if (n <= 0)
+			continue; /* blank line */
+
+		int c = sched_cause_parse(curr);
+		int l = sched_cause_parse(last);
+		if (n != 4 || c < -1 || l < -1 || slice == 0 || slice > 1000)
+			FATAL("Bad line in the MLFQ feedback table");
+
+		sched_feedback_set(c, l, delta, slice);
+	}
+
+	fclose(f);
+}
+
+/*
+  Adjust the priority and time slice of a thread that yields.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_feedback_apply(TCB* tcb)
+{
+	sched_feedback* fb = &SCHED_FEEDBACK[tcb->curr_cause][tcb->last_cause];
+
+	int priority = tcb->priority + fb->priority_delta;
+	if (priority < 0)
+		priority = 0;
+	if (priority > SCHED_QUEUES - 1)
+		priority = SCHED_QUEUES - 1;
+
+	tcb->priority = priority;
+	tcb->its = QUANTUM * fb->slice_percent / 100;
+}
+
+/*
+  CPU bandwidth control.
+
+  The scheduler charges the CPU time of every thread to the process group
+  of its process, at every yield, and limits the time slice of a thread to
+  the quota left to its group. When the quota is exhausted, the group is
+  throttled: its threads are kept in its throttled_threads list, instead of
+  the scheduler queue, until the end of the period. The throttled groups
+  are checked at every yield, which happens at least once per quantum on 
+  every unparked core.
+*/
+static rlnode throttled_groups; /* The list of throttled groups */
+
+static void sched_queue_add(TCB* tcb); /* forward */
+
+static inline PGRP* thread_group(TCB* tcb)
+{
+	return (tcb->owner_pcb == NULL) ? NULL : tcb->owner_pcb->group;
+}
+
+/* Start a new period for the group, if the current one has ended */
+static void group_roll_period(PGRP* g, TimerDuration now)
+{
+	if (now - g->period_start >= g->period) {
+		g->period_start = now - (now - g->period_start) % g->period;
+		g->runtime = 0;
+	}
+}
+
+/*
+  Charge the CPU time of a thread to its group.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_group_charge(TCB* tcb, TimerDuration runtime, TimerDuration now)
+{
+	/* The PCB of an exited thread may have been released */
+	PGRP* g = (tcb->state == EXITED) ? NULL : thread_group(tcb);
+	if (g == NULL || g->quota == 0)
+		return;
+
+	group_roll_period(g, now);
+	g->runtime += runtime;
+
+	if (g->runtime >= g->quota && !g->throttled) {
+		g->throttled = 1;
+		rlist_push_back(&throttled_groups, &g->throttled_node);
+	}
+}
+
+/*
+  Limit a time slice of a thread to the quota left to its group.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static TimerDuration sched_group_slice(TCB* tcb, TimerDuration slice, TimerDuration now)
+{
+	PGRP* g = thread_group(tcb);
+	if (g == NULL || g->quota == 0)
+		return slice;
+
+	group_roll_period(g, now);
+	TimerDuration left = (g->quota > g->runtime) ? g->quota - g->runtime : 1;
+	return (left < slice) ? left : slice;
+}
+
+/* 
+  Unthrottle a group, moving its threads to the scheduler queue. 
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_group_unthrottle(PGRP* g)
+{
+	g->throttled = 0;
+	rlist_remove(&g->throttled_node);
+	while (!is_rlist_empty(&g->throttled_threads))
+		sched_queue_add(rlist_pop_front(&g->throttled_threads)->tcb);
+}
+
+/*
+  Unthrottle the groups whose period has ended.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_group_replenish(TimerDuration now)
+{
+	rlnode* p = throttled_groups.next;
+	while (p != &throttled_groups) {
+		PGRP* g = p->obj;
+		p = p->next;
+
+		if (now - g->period_start >= g->period) {
+			group_roll_period(g, now);
+			sched_group_unthrottle(g);
+		}
+	}
+}
+
+PGRP* group_create(PCB* leader)
+{
+	PGRP* g = (PGRP*)xmalloc(sizeof(PGRP));
+	g->refcount = 1;
+	g->leader = leader;
+	g->quota = 0;
+	g->period = 0;
+	g->period_start = bios_clock();
+	g->runtime = 0;
+	g->throttled = 0;
+	rlnode_init(&g->throttled_threads, NULL);
+	rlnode_init(&g->throttled_node, g);
+	return g;
+}
+
+void group_incref(PGRP* g)
+{
+	if (g != NULL)
+		__atomic_fetch_add(&g->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void group_decref(PGRP* g)
+{
+	if (g == NULL || __atomic_sub_fetch(&g->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	/* No member processes, so no threads: just remove it from the throttled list */
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+	if (g->throttled)
+		rlist_remove(&g->throttled_node);
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+
+	free(g);
+}
+
+void group_set_quota(PGRP* g, TimerDuration quota, TimerDuration period)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	g->quota = quota;
+	g->period = period;
+	g->period_start = bios_clock();
+	g->runtime = 0;
+	if (g->throttled)
+		sched_group_unthrottle(g);
+
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
+void set_process_group(PCB* pcb, PGRP* g)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	PGRP* old = pcb->group;
+	pcb->group = g;
+
+	if (old != NULL) {
+		if (old->leader == pcb)
+			old->leader = NULL;
+
+		/* Move the throttled threads of the process to the new group */
+		if (old->throttled) {
+			rlnode* p = old->throttled_threads.next;
+			while (p != &old->throttled_threads) {
+				TCB* tcb = p->tcb;
+				p = p->next;
+				if (tcb->owner_pcb == pcb) {
+					rlist_remove(&tcb->sched_node);
+					sched_queue_add(tcb);
+				}
+			}
+		}
+	}
+
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+
+	group_decref(old);
+}
+
+/*
+  Core parking.
+
+  When utilization is low, cores are parked: a parked core only runs its
+  idle thread, does not set a timer while idle, and does not receive
+  restarts when threads become ready. Thus, the ready threads are consolidated
+  on the unparked cores. Parked cores are unparked as utilization, or the 
+  scheduler queue, grows.
+
+  The policy is evaluated by core 0 (which is never parked) every PARK_PERIOD,
+  based on the time each unparked core spent in its idle thread.
+ */
+#define PARK_PERIOD (100000L) /* The period of the parking policy, in usec */
+#define PARK_UTIL_LOW 30 /* Park a core below this avg. utilization (%) */
+#define PARK_UTIL_HIGH 80 /* Unpark a core above this avg. utilization (%) */
+
+static uint32_t parked_cores; /* Bit vector of parked cores */
+static uint32_t idle_cores; /* Bit vector of cores waiting in their idle thread */
+static unsigned int spinning_cores; /* Number of cores polling in their idle window */
+static TimerDuration park_period_start;
+
+static inline int core_is_parked(uint c)
+{
+	return (__atomic_load_n(&parked_cores, __ATOMIC_RELAXED) & (1u << c)) != 0;
+}
+
+/*
+  Restart some halted core, which is not parked.
+
+  No core is restarted while the cores polling in their idle window are
+  enough for the ready threads, since they will find the work themselves.
+  The fence pairs with the one in idle_wait(), so that either we see a
+  polling core, or that core sees the new thread before it halts.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+ */
+static void sched_restart_core()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (sched_ready_count <= __atomic_load_n(&spinning_cores, __ATOMIC_RELAXED))
+		return;
+
+	uint32_t parked = __atomic_load_n(&parked_cores, __ATOMIC_RELAXED);
+
+	if (parked == 0) {
+		cpu_core_restart_one();
+	} else {
+		uint32_t idle = __atomic_load_n(&idle_cores, __ATOMIC_RELAXED) & ~parked;
+		if (idle != 0)
+			cpu_core_restart(__builtin_ctz(idle));
+	}
+}
+
+/*
+  Evaluate the parking policy. This is called by core 0, at each ALARM.
+ */
+static void core_parking_policy()
+{
+	TimerDuration now = bios_clock();
+	TimerDuration period = now - park_period_start;
+	if (period < PARK_PERIOD)
+		return;
+	park_period_start = now;
+
+	uint ncores = cpu_cores();
+	uint32_t parked = __atomic_load_n(&parked_cores, __ATOMIC_RELAXED);
+	uint32_t unparked = ((ncores < 32) ? (1u << ncores) - 1 : ~0u) & ~parked;
+
+	/* Collect the idle time of the unparked cores */
+	TimerDuration idle = 0;
+	for (uint c = 0; c < ncores; c++) {
+		TimerDuration t = __atomic_exchange_n(&cctx[c].idle_time, 0, __ATOMIC_RELAXED);
+		if (unparked & (1u << c))
+			idle += (t < period) ? t : period;
+	}
+
+	uint active = __builtin_popcount(unparked);
+	unsigned int util = 100 - (100 * idle) / (active * period);
+
+	if (parked != 0 && (util > PARK_UTIL_HIGH || sched_ready_count > active)) {
+		/* Unpark the lowest parked core */
+		uint c = __builtin_ctz(parked);
+		__atomic_fetch_and(&parked_cores, ~(1u << c), __ATOMIC_RELAXED);
+		cpu_core_restart(c);
+	} else if (active > 1 && util < PARK_UTIL_LOW) {
+		/* Park the highest unparked core */
+		uint c = 31 - __builtin_clz(unparked);
+		__atomic_fetch_or(&parked_cores, 1u << c, __ATOMIC_RELAXED);
+	}
+}
+
+static void sched_wakeup_expired_timeouts(); /* forward */
+static TimerDuration sched_timer_delay(TimerDuration quantum); /* forward */
+
+/* 
+  Interrupt handler for ALARM. 
+
+  If the quantum has not ended, the alarm was set for a timeout, and the
+  current thread continues after the expired timeouts are processed.
+ */
+void yield_handler()
+{
+	if (cpu_core_id == 0)
+		core_parking_policy();
+
+	if (CURCORE.quantum_left > 0) {
+		Mutex_Lock(&sched_spinlock);
+		sched_wakeup_expired_timeouts();
+		TimerDuration delay = sched_timer_delay(CURCORE.quantum_left);
+		Mutex_Unlock(&sched_spinlock);
+
+		if (delay != NO_TIMEOUT)
+			bios_set_timer(delay);
+		return;
+	}
+
+	yield(SCHED_QUANTUM);
+}
+
+/*
+  The slow path of a preemption check point, see preempt_point().
+ */
+void preempt_yield()
+{
+	if (get_core_preemption())
+		yield(SCHED_QUANTUM);
+}
 
 /* Interrupt handle for inter-core interrupts */
 void ici_handler()
@@ -245,6 +857,12 @@ void ici_handler()
 /*
   Possibly add TCB to the scheduler timeout list.
 
+  The thread may be woken up as late as its timer slack after the timeout.
+  Within this window, it joins the earliest expiry already in the list, or
+  else the next multiple of its slack. Thus, nearby timeouts are batched
+  into one expiry and one timer interrupt. The slack is limited to 1/8 of
+  the timeout, so that short timeouts stay precise.
+
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
@@ -252,14 +870,31 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
+		TimerDuration deadline = curtime + timeout;
+		TimerDuration slack = tcb->timer_slack;
+		if (slack > timeout / 8)
+			slack = timeout / 8;
+
+		/* round up to the slack */
+		tcb->wakeup_time = (slack > 0) ? ((deadline + slack - 1) / slack) * slack : deadline;
+
+		/* add to the timeout list of this core in sorted order */
+		rlnode* timeout_list = &CURCORE.timeout_list;
+		rlnode* n = timeout_list->next;
+		for (; n != timeout_list; n = n->next)
 			/* skip earlier entries */
+			if (deadline <= n->tcb->wakeup_time)
+				break;
+
+		/* join the next expiry, if it is within the slack */
+		if (n != timeout_list && n->tcb->wakeup_time < tcb->wakeup_time)
+			tcb->wakeup_time = n->tcb->wakeup_time;
+
+		/* skip entries of the same expiry */
+		for (; n != timeout_list; n = n->next)
 			if (tcb->wakeup_time < n->tcb->wakeup_time)
 				break;
+
 		/* insert before n */
 		rl_splice(n->prev, &tcb->sched_node);
 	}
@@ -272,11 +907,19 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 */
 static void sched_queue_add(TCB* tcb)
 {
+	/* The threads of a throttled group wait for the next period */
+	PGRP* g = thread_group(tcb);
+	if (g != NULL && g->throttled) {
+		rlist_push_back(&g->throttled_threads, &tcb->sched_node);
+		return;
+	}
+
 	/* Insert at the end of the scheduling list */
 	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	sched_ready_count++;
 
 	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	sched_restart_core();
 }
 
 /*
@@ -288,9 +931,9 @@ static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from its timeout list */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in a timeout list, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(&tcb->sched_node);
 		tcb->wakeup_time = NO_TIMEOUT;
@@ -305,24 +948,63 @@ static void sched_make_ready(TCB* tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Scan the timeout list of the current core for threads whose timeout 
+  has expired, and wake them up.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
 static void sched_wakeup_expired_timeouts()
 {
+	rlnode* timeout_list = &CURCORE.timeout_list;
+
 	/* Empty the timeout list up to the current time and wake up each thread */
 	TimerDuration curtime = bios_clock();
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
+	while (!is_rlist_empty(timeout_list)) {
+		TCB* tcb = timeout_list->next->tcb;
 		if (tcb->wakeup_time > curtime)
 			break;
 		sched_make_ready(tcb);
 	}
 }
 
+/*
+  Return the delay for the core timer, given that the current quantum ends
+  after 'quantum' usec (or never, if it is NO_TIMEOUT). This is the earlier
+  of the end of the quantum and the next timeout expiry of the current core.
+  If the timer fires before the end of the quantum, the rest of the quantum
+  is stored in CURCORE.quantum_left.
+
+  In cooperative mode, the quantum handled here is the full quantum plus 
+  PREEMPT_GRACE, and its end is recorded in CURCORE.preempt_deadline, by
+  the first call for the quantum.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static TimerDuration sched_timer_delay(TimerDuration quantum)
+{
+	rlnode* timeout_list = &CURCORE.timeout_list;
+
+	if (preempt_mode == PREEMPT_COOP && quantum != NO_TIMEOUT
+		&& CURCORE.preempt_deadline == NO_TIMEOUT) {
+		CURCORE.preempt_deadline = bios_clock() + quantum;
+		quantum += PREEMPT_GRACE;
+	}
+
+	TimerDuration delay = quantum;
+
+	if (!is_rlist_empty(timeout_list)) {
+		TimerDuration wakeup_time = timeout_list->next->tcb->wakeup_time;
+		TimerDuration curtime = bios_clock();
+		TimerDuration expiry = (wakeup_time > curtime) ? wakeup_time - curtime : 1;
+		if (expiry < delay)
+			delay = expiry;
+	}
+
+	CURCORE.quantum_left = (quantum == NO_TIMEOUT) ? 0 : quantum - delay;
+	return delay;
+}
+
 /*
   Remove the head of the scheduler list, if any, and
   return it. Return NULL if the list is empty.
@@ -331,6 +1013,12 @@ static void sched_wakeup_expired_timeouts()
 */
 static TCB* sched_queue_select(TCB* current)
 {
+	/* A parked core only runs its idle thread */
+	if (core_is_parked(cpu_core_id)) {
+		CURCORE.idle_thread.its = QUANTUM;
+		return &CURCORE.idle_thread;
+	}
+
 	int head = SCHED_QUEUES - 1;
 
 	for(int i = SCHED_QUEUES - 1; i>=0; i--){
@@ -346,10 +1034,11 @@ static TCB* sched_queue_select(TCB* current)
 
 	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
-
-	next_thread->its = QUANTUM;
+	if (next_thread != NULL)
+		sched_ready_count--;
+	else
+		next_thread = (current->state == READY && !(thread_group(current) && thread_group(current)->throttled))
+			? current : &CURCORE.idle_thread;
 
 	return next_thread;
 }
@@ -381,6 +1070,39 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+/*
+  Each thread that is queued restarts a halted core, if there is one and
+  the polling idle cores are not enough, so a batch of new threads is 
+  spread over the idle cores.
+ */
+int wakeup_many(TCB** tcbs, int n)
+{
+	int ret = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	Mutex_Lock(&sched_spinlock);
+
+	for (int i = 0; i < n; i++) {
+		TCB* tcb = tcbs[i];
+		if (tcb->state == STOPPED || tcb->state == INIT) {
+			sched_make_ready(tcb);
+			ret++;
+		}
+	}
+
+	Mutex_Unlock(&sched_spinlock);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+static void yield_locked(enum SCHED_CAUSE cause, int preempt); /* forward */
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -392,6 +1114,10 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
+
+	/* Reset the timer, so that we are not interrupted by ALARM */
+	bios_cancel_timer();
+
 	Mutex_Lock(&sched_spinlock);
 
 	/* mark the thread as stopped or exited */
@@ -405,15 +1131,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
-	/* call this to schedule someone else */
-	yield(cause);
-
-	/* Restore preemption state */
-	if (preempt)
-		preempt_on;
+	/* Schedule someone else, keeping the scheduler spinlock. This restores preemption. */
+	yield_locked(cause, preempt);
 }
 
 /* This function is the entry point to the scheduler's context switching */
@@ -421,53 +1140,62 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 void yield(enum SCHED_CAUSE cause)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
+	bios_cancel_timer();
 
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	Mutex_Lock(&sched_spinlock);
 
-	yield_counter++;	// Add 1 to counter for the MLFQ
+	yield_locked(cause, preempt);
+}
 
+/*
+  The body of yield(). The caller has cancelled the core timer, and
+  'preempt' is the preemption state to restore when the current thread
+  runs again. The thread gets a new time slice in gain().
 
-	Mutex_Lock(&sched_spinlock);
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  The lock is released by gain(), in the thread we switch to.
+*/
+static void yield_locked(enum SCHED_CAUSE cause, int preempt)
+{
+	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+
+	yield_counter++;	// Add 1 to counter for the MLFQ
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
 		current->state = READY;
 
+	/* Account the CPU time of the current thread, also to its group */
+	TimerDuration now = bios_clock();
+	sched_group_charge(current, now - current->run_start, now);
+	current->cpu_time += now - current->run_start;
+	current->run_start = now;
+
+	/* Unthrottle the groups whose period has ended */
+	if (!is_rlist_empty(&throttled_groups))
+		sched_group_replenish(now);
+
 	/* Update CURTHREAD scheduler data */
-	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
+	CURCORE.quantum_left = 0;
+	CURCORE.preempt_deadline = NO_TIMEOUT;
 
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	/* At the ALARM, wake up threads whose sleep timeout has expired */
+	if (cause == SCHED_QUANTUM)
+		sched_wakeup_expired_timeouts();
 
 	if(yield_counter > 2000){
 		boost();	//boosting the thread's priority by 1, to avoid starvation
 		yield_counter = 0;	//since we fixed the problem we set yield_counter back to 0
 	}
 
-	if(current->priority != 0){
-		switch(cause){
-
-		case SCHED_QUANTUM:
-			current->priority--;
-
-		case SCHED_IO:
-			if(current->priority == SCHED_QUEUES){
-				current->priority = SCHED_QUEUES;
-			}else{
-				current->priority++;
-			}
-
-		case SCHED_MUTEX:
-			current->priority--;
-
-		}
-	}
+	/* Adjust the priority and time slice, by the MLFQ feedback table */
+	if (current->type != IDLE_THREAD)
+		sched_feedback_apply(current);
 
 
 	/* Get next */
@@ -477,10 +1205,12 @@ void yield(enum SCHED_CAUSE cause)
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
-
-	/* Switch contexts */
+	/* 
+	   Switch contexts. The sched_spinlock is handed over to the next
+	   thread, which releases it in gain().
+	 */
 	if (current != next) {
+		current->ctx_switches++;
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -501,18 +1231,21 @@ void yield(enum SCHED_CAUSE cause)
   in the new timeslice. When returning to threads in the non-preemptive
   domain (e.g., waiting at some driver), we need to not turn preemption
   on!
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  The lock is taken by the yield() that switched to this thread, and
+  it is released here.
 */
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->run_start = bios_clock();
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
@@ -524,7 +1257,8 @@ void gain(int preempt)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			/* It will be released after we unlock */
+			rlist_push_back(&CURCORE.reap_list, &prev->sched_node);
 			break;
 		case STOPPED:
 			break;
@@ -533,14 +1267,129 @@ void gain(int preempt)
 		}
 	}
 
+	/* A 1-quantum alarm (or earlier, for a timeout), unless we idle at a parked core */
+	int idle_parked = current->type == IDLE_THREAD && core_is_parked(cpu_core_id);
+	TimerDuration slice = sched_group_slice(current, current->rts, current->run_start);
+	TimerDuration delay = sched_timer_delay(idle_parked ? NO_TIMEOUT : slice);
+
 	Mutex_Unlock(&sched_spinlock);
 
+	/* Release any exited threads, outside the critical section */
+	reap_exited_threads();
+
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set the alarm */
+	if (delay != NO_TIMEOUT)
+		bios_set_timer(delay);
+}
+
+/*
+  Return 1 if all the scheduler queues look empty. This is only a hint,
+  as it is called without sched_spinlock.
+ */
+static int sched_queues_empty()
+{
+	for (int i = 0; i < SCHED_QUEUES; i++)
+		if (!is_rlist_empty(&SCHED[i]))
+			return 0;
+	return 1;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/*
+  Adapt the idle polling window of a core, given the length of its last
+  idle interval. The window covers twice the average idle interval, as long
+  as this is at most IDLE_SPIN_MAX; else, the core halts directly.
+ */
+static void idle_spin_adapt(CCB* core, TimerDuration interval)
+{
+	core->idle_interval = (7 * core->idle_interval + interval) / 8;
+
+	TimerDuration window = 2 * core->idle_interval;
+	core->idle_spin_window = (window <= IDLE_SPIN_MAX) ? window : 0;
+}
+
+/*
+  Wait for work to appear, by polling the scheduler queues for the
+  adaptive window, and then halting the core. While polling, the core
+  is counted in spinning_cores, so that new threads do not restart
+  a halted core needlessly.
+
+  This runs with preemption off, so that an ALARM cannot switch the idle
+  thread out while the core is counted in spinning_cores or idle_cores.
+  Interrupts raised meanwhile are dispatched when preemption is restored.
+  For this reason, the polling window ends at the next timeout expiry of
+  the core, and a halted core returns as soon as an interrupt is pending.
+ */
+static void idle_wait()
+{
+	int preempt = preempt_off;
+
+	CCB* core = &CURCORE;
+	uint32_t cmask = 1u << cpu_core_id;
+	TimerDuration start = bios_clock();
+	TimerDuration now = start;
+
+	/* A parked core does not poll */
+	TimerDuration window = core_is_parked(cpu_core_id) ? 0 : core->idle_spin_window;
+
+	if (window > 0) {
+		Mutex_Lock(&sched_spinlock);
+		rlnode* timeout_list = &core->timeout_list;
+		if (!is_rlist_empty(timeout_list)) {
+			TimerDuration wakeup_time = timeout_list->next->tcb->wakeup_time;
+			TimerDuration expiry = (wakeup_time > start) ? wakeup_time - start : 0;
+			if (expiry < window)
+				window = expiry;
+		}
+		Mutex_Unlock(&sched_spinlock);
+	}
+
+	int found = 0;
+	if (window > 0) {
+		__atomic_fetch_add(&spinning_cores, 1, __ATOMIC_RELAXED);
+
+		while (now - start < window) {
+			if (!sched_queues_empty()) {
+				found = 1;
+				break;
+			}
+			cpu_relax();
+			now = bios_clock();
+		}
+
+		/* Threads queued before we stopped polling did not restart a core */
+		__atomic_fetch_sub(&spinning_cores, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		found = found || !sched_queues_empty();
+	}
+
+	if (found) {
+		core->idle_spin_hits++;
+	} else {
+		core->idle_halts++;
+		__atomic_fetch_or(&idle_cores, cmask, __ATOMIC_RELAXED);
+		cpu_core_halt();
+		__atomic_fetch_and(&idle_cores, ~cmask, __ATOMIC_RELAXED);
+		now = bios_clock();
+	}
+
+	idle_spin_adapt(core, now - start);
+	__atomic_fetch_add(&core->idle_time, now - start, __ATOMIC_RELAXED);
+
+	if (preempt)
+		preempt_on;
 }
 
 static void idle_thread()
@@ -549,8 +1398,8 @@ static void idle_thread()
 	yield(SCHED_IDLE);
 
 	/* We come here whenever we cannot find a ready thread for our core */
-	while (active_threads > 0) {
-		cpu_core_halt();
+	while (active_thread_count() > 0) {
+		idle_wait();
 		yield(SCHED_IDLE);
 	}
 
@@ -569,9 +1418,31 @@ void initialize_scheduler()
 		rlnode_init(&SCHED[i], NULL);
 	}
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	rlnode_init(&throttled_groups, NULL);
+
+	sched_ready_count = 0;
+
+	parked_cores = 0;
+	idle_cores = 0;
+	spinning_cores = 0;
+	park_period_start = bios_clock();
 
 	yield_counter = 0;
+
+	/* Load the MLFQ feedback table */
+	sched_feedback_defaults();
+	const char* table = getenv("TINYOS_MLFQ_TABLE");
+	if (table != NULL)
+		sched_feedback_load(table);
+
+	/* Select the preemption mode */
+	const char* mode = getenv("TINYOS_PREEMPT");
+	if (mode == NULL || strcmp(mode, "signal") == 0)
+		preempt_mode = PREEMPT_SIGNAL;
+	else if (strcmp(mode, "coop") == 0)
+		preempt_mode = PREEMPT_COOP;
+	else
+		FATAL("TINYOS_PREEMPT must be \"signal\" or \"coop\"");
 }
 
 void run_scheduler()
@@ -583,11 +1454,23 @@ void run_scheduler()
 
 	curcore->current_thread = &curcore->idle_thread;
 
+	rlnode_init(&curcore->reap_list, NULL);
+	rlnode_init(&curcore->timeout_list, NULL);
+	curcore->quantum_left = 0;
+	curcore->preempt_deadline = NO_TIMEOUT;
+
+	curcore->idle_interval = 0;
+	curcore->idle_spin_window = 0;
+	curcore->idle_spin_hits = 0;
+	curcore->idle_halts = 0;
+	curcore->idle_time = 0;
+
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.timer_slack = TIMER_SLACK;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.priority = 0;	// idle threads priorit is set to 0
@@ -598,6 +1481,13 @@ void run_scheduler()
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
+	curcore->idle_thread.run_start = bios_clock();
+	curcore->idle_thread.cpu_time = 0;
+	curcore->idle_thread.ctx_switches = 0;
+	curcore->idle_thread.bytes_read = 0;
+	curcore->idle_thread.bytes_written = 0;
+	curcore->idle_thread.release_owner = 0;
+
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
 	cpu_interrupt_handler(ICI, ici_handler);
@@ -613,11 +1503,12 @@ void run_scheduler()
 }
 
 void boost(){
-	for(int i = SCHED_QUEUES-1; i>=0; i--){
+	/* The threads of the highest queue stay there */
+	for(int i = SCHED_QUEUES-2; i>=0; i--){
 		while(!is_rlist_empty(&SCHED[i])){
 			rlnode* curnode = rlist_pop_front(&SCHED[i]);
 			curnode->tcb->priority++;
-			rlist_push_front(&SCHED[i+1], curnode);
+			rlist_push_back(&SCHED[i+1], curnode);
 		}
 	}
 }
@@ -144,6 +144,9 @@ typedef struct thread_control_block {
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	TimerDuration timer_slack; /**< @brief How late a timeout of this thread may expire, to be batched with others */
+
+	size_t stack_size; /**< @brief The size of the thread stack */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -152,6 +155,14 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	TimerDuration run_start; /**< @brief The time the thread was last switched in */
+	TimerDuration cpu_time; /**< @brief CPU time used by the thread */
+	unsigned long ctx_switches; /**< @brief Context switches away from the thread */
+	unsigned long bytes_read; /**< @brief Bytes read by the thread */
+	unsigned long bytes_written; /**< @brief Bytes written by the thread */
+
+	int release_owner; /**< @brief Non-zero if the owner PCB is released when the exited thread is released */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -173,6 +184,19 @@ void boost();
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Minimum thread stack size.
+
+  Smaller stack sizes requested by @c spawn_thread_stack() are rounded
+  up to this size.
+ */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief Maximum thread stack size.
+
+  Larger stack sizes requested by @c spawn_thread_stack() are refused.
+ */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
@@ -190,12 +214,98 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	rlnode reap_list; /**< @brief Exited TCBs waiting to be released by this core */
+
+	rlnode timeout_list; /**< @brief Threads sleeping with a timeout, sorted by wakeup time */
+	TimerDuration quantum_left; /**< @brief Quantum remaining when the timer fires for a timeout */
+	TimerDuration preempt_deadline; /**< @brief End of the quantum in cooperative mode, else @c NO_TIMEOUT */
+
+	volatile unsigned long threads_spawned; /**< @brief Threads spawned on this core */
+	volatile unsigned long threads_released; /**< @brief Threads released on this core */
+
+	TimerDuration idle_interval; /**< @brief Average time the idle thread waits for work */
+	TimerDuration idle_spin_window; /**< @brief Time the idle thread polls before halting */
+	unsigned long idle_spin_hits; /**< @brief Idle waits that found work while polling */
+	unsigned long idle_halts; /**< @brief Idle waits that halted the core */
+	TimerDuration idle_time; /**< @brief Time spent idle, since the last parking decision */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
 
+/**
+  @brief Process group.
+
+  A process group shares a CPU quota among the threads of its processes:
+  they may run for at most @c quota microseconds in every @c period. When the
+  quota is exhausted, the group is throttled until the end of the period.
+  New processes join the group of their parent.
+
+  All fields except @c refcount are protected by the scheduler spinlock.
+ */
+typedef struct process_group {
+	int refcount; /**< @brief The number of member processes */
+	PCB* leader; /**< @brief The process the group was created for, or NULL if it has exited */
+
+	TimerDuration quota; /**< @brief CPU time per period, or 0 for no limit */
+	TimerDuration period; /**< @brief The quota period */
+	TimerDuration period_start; /**< @brief The start of the current period */
+	TimerDuration runtime; /**< @brief CPU time used in the current period */
+
+	int throttled; /**< @brief Non-zero while the quota is exhausted */
+	rlnode throttled_threads; /**< @brief Ready threads of the group, while throttled */
+	rlnode throttled_node; /**< @brief Node in the list of throttled groups */
+} PGRP;
+
+/**
+  @brief Create a new process group, without a quota.
+
+  @param leader the process the group is created for
+  @returns the new group, with one reference
+ */
+PGRP* group_create(PCB* leader);
+
+/** @brief Add a reference to a process group, which may be NULL */
+void group_incref(PGRP* group);
+
+/** @brief Release a reference to a process group, which may be NULL */
+void group_decref(PGRP* group);
+
+/**
+  @brief Set the CPU quota of a process group.
+
+  @param group the process group
+  @param quota the CPU time per period, or 0 for no limit
+  @param period the period
+ */
+void group_set_quota(PGRP* group, TimerDuration quota, TimerDuration period);
+
+/**
+  @brief Move a process to another process group.
+
+  The reference of the process to the new group is passed by the caller, 
+  and the reference to the old group is released.
+
+  @param pcb the process
+  @param group the new group, or NULL
+ */
+void set_process_group(PCB* pcb, PGRP* group);
+
+
+/**
+  @brief The number of active threads.
+
+  By "active", we mean 'existing', with the exception of idle threads.
+  The count is aggregated on demand from the per-core counters of the CCBs,
+  so it is only a snapshot. However, a return value of 0 is reliable:
+  it means that there are no more threads in the system.
+
+  @returns the number of active threads
+*/
+unsigned int active_thread_count();
+
 /** 
   @brief The current thread.
 
@@ -236,9 +346,46 @@ TCB* cur_thread();
 
     @param func The function to execute in the new thread.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+              If the thread memory cannot be allocated, this is fatal.
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+	@brief Create a new thread with a given stack size.
+
+	This is the same as @c spawn_thread(), except that the new thread
+	has a stack of (at least) @c stack_size bytes. The stack memory is
+	committed lazily, as it is used.
+
+    @param pcb  The process control block of the owning process.
+    @param func The function to execute in the new thread.
+    @param stack_size The stack size, or 0 for @c THREAD_STACK_SIZE. It is
+                rounded up to a multiple of the page size, and to at least
+                @c THREAD_STACK_MIN.
+    @returns  A pointer to the TCB of the new thread, in the @c INIT state,
+              or NULL if @c stack_size is larger than @c THREAD_STACK_MAX, or
+              the thread memory cannot be allocated.
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+	@brief Create many new threads.
+
+	This is the same as calling @c spawn_thread(pcbs[i],func) for every i, 
+	but the thread stacks are allocated, and the threads are counted,
+	in one batch.
+
+    @param pcbs The process control blocks of the owning processes.
+    @param n    The number of threads.
+    @param func The function to execute in the new threads.
+    @param tcbs An array of @c n elements, where the TCBs of the new threads
+                are returned, in the @c INIT state.
+    @returns  The number of new threads, which is less than @c n if the 
+              thread memory cannot be allocated. The threads of the first
+              pcbs are created.
+*/
+int spawn_threads(PCB** pcbs, int n, void (*func)(), TCB** tcbs);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -251,6 +398,18 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup many blocked threads.
+
+  This is equivalent to calling @c wakeup() on each thread, but it
+  enters the scheduler only once.
+
+  @param tcbs an array of threads to be made @c READY
+  @param n the number of threads
+  @returns the number of threads whose state was @c STOPPED or @c INIT
+*/
+int wakeup_many(TCB** tcbs, int n);
+
 /** 
   @brief Block the current thread.
 
@@ -292,6 +451,63 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Preemption modes.
+
+  In @c PREEMPT_SIGNAL mode, the ALARM interrupt preempts the current thread
+  at the end of its quantum. In @c PREEMPT_COOP mode, the end of the quantum
+  is only recorded for the core, and the current thread yields at the next
+  preemption check point, see @c preempt_point(). The ALARM then serves as a
+  fallback, raised @c PREEMPT_GRACE after the end of the quantum.
+
+  Since the only check point is @c PreemptPoint(), cooperative mode is in
+  effect a grace-period extension: a thread that never calls it runs for its
+  quantum plus @c PREEMPT_GRACE, and is then preempted by the ALARM.
+
+  The mode is selected at boot, by the TINYOS_PREEMPT environment variable,
+  which can be "signal" (the default) or "coop"; any other value is a fatal
+  error.
+ */
+enum PREEMPT_MODE {
+	PREEMPT_SIGNAL, /**< @brief Preempt at the ALARM */
+	PREEMPT_COOP    /**< @brief Preempt at check points */
+};
+
+/** @brief The preemption mode of the scheduler */
+extern enum PREEMPT_MODE preempt_mode;
+
+/**
+  @brief Yield at a preemption check point.
+
+  This is the slow path of @c preempt_point(), taken when the quantum
+  has ended. It yields, unless preemption is off.
+ */
+void preempt_yield();
+
+/**
+  @brief A preemption check point.
+
+  In cooperative preemption mode, yield if the quantum of the current thread
+  has ended. Otherwise, this is a no-op. It must be called in the preemptive 
+  domain, without the kernel lock, at points where the caller can be preempted.
+
+  The check does not lock anything. In signal mode, @c preempt_deadline is
+  always @c NO_TIMEOUT, so it is a single load. If the thread has just moved
+  to another core, it may yield once early.
+
+  The only check point is @c PreemptPoint(), called by user code. System
+  calls do not check on exit, and @c Mutex_Lock does not check while it
+  spins, so code without calls to @c PreemptPoint() is preempted by the
+  ALARM, @c PREEMPT_GRACE after its quantum.
+ */
+static inline void preempt_point()
+{
+	TimerDuration deadline = __atomic_load_n(&cctx[cpu_core_id].preempt_deadline, __ATOMIC_RELAXED);
+
+	if (deadline != NO_TIMEOUT && bios_clock() >= deadline)
+		preempt_yield();
+}
+
 /**
   @brief Enter the scheduler.
 
@@ -308,6 +524,24 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Default timer slack (in microseconds)
+
+  A thread sleeping with a timeout may be woken up up to its timer slack
+  after the timeout expires, so that nearby timeouts are batched into a 
+  single expiry. The slack of a timeout is at most 1/8 of the timeout.
+  */
+#define TIMER_SLACK (50L)
+
+/**
+  @brief Maximum idle polling window (in microseconds)
+
+  Before halting, the idle thread polls the scheduler queues for a window
+  that adapts to the recent idle intervals of the core. If work does not
+  usually arrive within this time, the idle thread halts the core directly.
+  */
+#define IDLE_SPIN_MAX (200L)
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -315,6 +549,14 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief Cooperative preemption grace period (in microseconds)
+
+  In cooperative mode, a thread that does not reach a check point within
+  this time after the end of its quantum is preempted by the ALARM.
+  */
+#define PREEMPT_GRACE (2000L)
+
 /** @} */
 
 #endif
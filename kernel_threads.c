@@ -7,10 +7,10 @@
 
 
 /** 
-  @brief Create a new thread in the current process.
+  @brief Create a new thread in the current process, with a given stack size.
   Initialize the ptcb and make the new thread READY.
   */
-Tid_t sys_CreateThread(Task task, int argl, void* args)
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
 {
 
   TCB* tcb; //Initialization of a thread (TCB)
@@ -21,10 +21,11 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
     a new thread in the current process . We do that by calling a function
     called : start_main_ptcb_thread 
   */
-  tcb = spawn_thread(curproc, start_main_ptcb_thread);
+  tcb = spawn_thread_stack(curproc, start_main_ptcb_thread, stack_size);
+  if(tcb == NULL) return NOTHREAD;  // Bad stack size, or out of memory
   acquire_ptcb(tcb, task, argl, args); // We acquire a ptcb with our new thread pointing at it 
   
-  curproc->thread_count++;  // Since we created a thread we add 1 to the count
+  account_thread_start(curproc, tcb);  // Since we created a thread we add 1 to the count
 	
   wakeup(tcb);  // thread becomes ready
 
@@ -33,6 +34,15 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 }
 
 
+/** 
+  @brief Create a new thread in the current process.
+  */
+Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+
 
 
 /**
@@ -45,6 +55,67 @@ Tid_t sys_ThreadSelf()
 
 
 
+/**
+  @brief Return the current time.
+  */
+unsigned long sys_GetTime()
+{
+  return bios_clock();
+}
+
+
+
+/**
+  @brief Sleep until a point in time.
+  The thread waits with a timeout at a condition variable that nobody
+  signals, so that the kernel lock is released while it sleeps.
+  */
+void sys_SleepUntil(unsigned long abs_usec)
+{
+  CondVar sleep_cv = COND_INIT;
+  TimerDuration now;
+
+  while((now = bios_clock()) < abs_usec)
+    kernel_timedwait(&sleep_cv, SCHED_USER, abs_usec - now);
+}
+
+
+
+/**
+  @brief Sleep for a time interval.
+  */
+void sys_Sleep(unsigned long usec)
+{
+  sys_SleepUntil(bios_clock() + usec);
+}
+
+
+
+/**
+  @brief Set the timer slack of the current thread.
+  */
+unsigned int sys_SetTimerSlack(unsigned int slack)
+{
+  TCB* tcb = cur_thread();
+  unsigned int old_slack = tcb->timer_slack;
+
+  tcb->timer_slack = slack;
+
+  return old_slack;
+}
+
+/**
+  @brief A user preemption check point.
+  This is not a system call: it is called without the kernel lock, so
+  that the check is cheap and the thread does not yield holding the lock.
+  */
+void PreemptPoint()
+{
+  preempt_point();
+}
+
+
+
 /**
   @brief Join the given thread.
   When the current thread is in RUNNING state, it stops running
@@ -169,11 +240,14 @@ void sys_ThreadExit(int exitval)
   kernel_broadcast(&(ptcb->exit_cv)); 
 
   PCB* curproc = CURPROC;
-  curproc->thread_count--;
+  account_thread_exit(curproc, cur_thread());
 
 
   if(curproc->thread_count == 0) {
 
+    /* Now, mark the process as exited; get_pcb() no longer returns it */
+    curproc->pstate = ZOMBIE;
+
     if(get_pid(curproc) != 1){
     /* Reparent any children of the exiting process to the 
        initial task */
@@ -186,14 +260,30 @@ void sys_ThreadExit(int exitval)
 
       /* Add exited children to the initial task's exited list 
          and signal the initial task */
-      if(!is_rlist_empty(& curproc->exited_list)) {
-        rlist_append(& initpcb->exited_list, &curproc->exited_list);
-        kernel_broadcast(& initpcb->child_exit);
+      reparent_zombies(curproc, initpcb);
+
+      /* Leave my parent's children list */
+      PCB* parent = curproc->parent;
+      rlist_remove(& curproc->children_node);
+
+      if(parent->autoreap) {
+        /* Nothing needs to remain of me; wake up waiters if there are no more children */
+        if(is_rlist_empty(& parent->children_list) && is_rlist_empty(& parent->exited_list))
+          kernel_broadcast(& parent->child_exit);
+      }
+      else {
+        /* 
+          Put my zombie record into my parent's exited list. Only one thread
+          waiting for any child can reap me.
+         */
+        make_zombie(curproc);
+        kernel_signal(& parent->child_exit);
       }
+      curproc->parent = NULL;
 
-      /* Put me into my parent's exited list */
-      rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-      kernel_broadcast(& curproc->parent->child_exit);
+      /* All threads waiting for me are woken up */
+      kernel_broadcast(& curproc->exit_cv);
+      notify_exit_handles(curproc);
 
     }
 
@@ -205,20 +295,22 @@ void sys_ThreadExit(int exitval)
       Do all the other cleanup we want here, close files etc. 
      */
 
-    /* Clean up PTCB list nodes*/
-
-    while(is_rlist_empty(&curproc->ptcb_list) != 0){
+    /* 
+      Release the resources of the process. Only the zombie record remains
+      until it is reaped. First, clean up PTCB list nodes.
+     */
+    while(!is_rlist_empty(&curproc->ptcb_list)){
 
       rlnode* ptcb_node;
       ptcb_node = rlist_pop_front(&curproc->ptcb_list);
       free(ptcb_node->ptcb);
     }
+    cur_thread()->ptcb = NULL;
 
     /* Release the args data */
-    if(curproc->args) {
-      free(curproc->args);
-      curproc->args = NULL;
-    }
+    argbuf_decref(curproc->argbuf);
+    curproc->argbuf = NULL;
+    curproc->args = NULL;
 
     /* Clean up FIDT */
     for(int i=0;i<MAX_FILEID;i++) {
@@ -229,11 +321,17 @@ void sys_ThreadExit(int exitval)
     }
 
 
+    /* Leave the process group */
+    set_process_group(curproc, NULL);
+
     /* Disconnect my main_thread */
     curproc->main_thread = NULL;
 
-    /* Now, mark the process as exited. */
-    curproc->pstate = ZOMBIE;
+    /* 
+      My PCB is released as soon as this thread has switched out, since
+      it is still in use until then. The PCB of init is never released.
+     */
+    cur_thread()->release_owner = (get_pid(curproc) != 1);
   }
 
 
@@ -25,6 +25,10 @@
 
 /**
   @brief The type of a process ID.
+
+  A process ID is non-negative, but it is not limited to MAX_PROC. 
+  The PID of a process that has been reaped does not denote any later
+  process, until about 2^15 processes have reused its process table slot.
   */
 typedef int Pid_t;		/* The PID type  */
 
@@ -222,6 +226,10 @@ typedef int (*Task)(int, void*);
   passing it a byte array. The byte array is described by a pair
   of  (int length,void* position), and is a _copy_ of the
   byte array defined by the (argl, args) pair of arguments to Exec.
+
+  As an exception, if @c args lies within the arguments of the current
+  process, and these are read-only (see @c ExecMany), the new process
+  shares them, read-only, instead of getting a copy.
   
   
   - The new process inherits all file ids of the current process.
@@ -240,6 +248,52 @@ typedef int (*Task)(int, void*);
   */
 Pid_t Exec(Task task, int argl, void* args);
 
+/** @brief Create a new process, with a given stack size for its main thread.
+
+  This call is the same as @c Exec, except that the main thread of the new
+  process is given a stack of (at least) @c stack_size bytes. The stack memory
+  is only committed as it is used.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the stack size of the main thread, or 0 for the default size
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c stack_size is larger than the maximum stack size (64 Mbytes).
+   -  The memory of the thread could not be allocated.
+  @see Exec
+  */
+Pid_t ExecStack(Task task, int argl, void* args, unsigned int stack_size);
+
+/** @brief Create many processes running the same task.
+
+  This call is similar to calling @c Exec(task,argl,args) @c count times,
+  but it is much faster: the arguments are stored once, and shared by all
+  the new processes, and the new processes are started together.
+
+  Unlike @c Exec, the new processes do not get a private copy of @c args:
+  the shared copy is read-only, and a process that writes to it faults.
+  A process created this way can pass its arguments, or a part of them,
+  to @c Exec or @c ExecMany, and its children share them without a copy.
+
+  @param task the main function of the new processes
+  @param count the number of processes to create
+  @param argl the length of byte array @c args
+  @param args the byte array copied, read-only, as argument to `task`
+  @param pids_out if not NULL, an array of @c count elements, where the pids
+    of the new processes are stored; the unused elements are set to @c NOPROC
+  @return the number of processes created, which is less than @c count if 
+    the maximum number of processes has been reached, or the memory of their
+    threads could not be allocated, or -1 if @c task is
+    NULL, @c count is not positive, or @c count is larger than the number of
+    free process IDs.
+  @see Exec
+  */
+int ExecMany(Task task, int count, int argl, void* args, Pid_t* pids_out);
+
 
 /** @brief Exit the current process.
 
@@ -279,6 +333,78 @@ void Exit(int val);
 */
 Pid_t WaitChild(Pid_t pid, int* exitval);
 
+/** @brief Open a handle to a child process.
+
+  The handle is a read-only stream which becomes readable when the child
+  exits. The first @c Read of at least @c sizeof(int) bytes stores the exit
+  status of the child in the buffer, and returns @c sizeof(int). If the
+  caller is the parent of the child, the child is also reaped, as by 
+  @c WaitChild. Subsequent reads return 0.
+
+  The read blocks until the child exits. A handle can be opened after the
+  child has exited, as long as it has not been reaped.
+
+  @param pid the pid of a child of the current process
+  @return a file id for the handle, or @c NOFILE on error. Possible errors:
+    - @c pid is not a child of the current process
+    - the available file ids for the process are exhausted
+  @see WaitChild
+  */
+Fid_t OpenChild(Pid_t pid);
+
+/** @brief Wait for any of many process handles.
+
+  Block until at least one of the process handles in @c fids is readable,
+  i.e., its child has exited, and return its index in @c fids. A @c Read
+  of that handle will not block. This allows a single thread to supervise
+  many children.
+
+  Only process handles can be waited for. Other streams, such as pipes
+  and sockets, cannot be mixed with them in one call.
+
+  @param fids an array of file ids of process handles, see @c OpenChild
+  @param n the number of elements of @c fids, at most @c MAX_FILEID
+  @return the index of a readable handle in @c fids, or -1 on error. 
+    Possible errors:
+    - @c n is not between 1 and @c MAX_FILEID
+    - some file id is not an open process handle, or it was closed
+      while waiting
+  @see OpenChild
+  */
+int WaitHandles(const Fid_t* fids, int n);
+
+/** @brief Set the CPU quota of a process.
+
+  The process is given a process group of its own (unless it already
+  has one), which is joined by all processes it creates afterwards, and
+  their descendants. All threads of the group together may run for at
+  most @c runtime microseconds in every @c period microseconds. When the
+  quota is exhausted, the threads of the group are not scheduled until the 
+  next period.
+
+  @param pid the current process or a child of it
+  @param runtime the CPU time per period, or 0 for no limit
+  @param period the period in microseconds
+  @return 0 on success, or -1 on error. Possible errors:
+    - @c pid is not the current process or a live child of it
+    - @c runtime is larger than @c period
+  */
+int SetCPUQuota(Pid_t pid, unsigned long runtime, unsigned long period);
+
+/** @brief Enable or disable automatic reaping of children.
+
+  When automatic reaping is enabled, the children of the current process
+  do not become zombies when they exit: their pids are released at once,
+  and they cannot be waited for by @c WaitChild. Existing zombie children
+  are reaped when automatic reaping is enabled. A process handle of a 
+  child (see @c OpenChild) still returns its exit status.
+
+  @param on non-zero to enable, zero to disable automatic reaping
+  @return the previous setting
+  @see WaitChild
+  */
+int SetAutoReap(int on);
+
 /** @brief Return the PID of the caller.
 
  This function returns the pid of the current process 
@@ -319,6 +445,22 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This call is the same as @c CreateThread, except that the new thread is
+  given a stack of (at least) @c stack_size bytes. Threads which need little
+  stack space can save a lot of memory this way.
+
+  @param task a function to execute
+  @param stack_size the stack size of the new thread, or 0 for the default size
+  @return the Tid of the new thread, or NOTHREAD if @c stack_size is larger
+    than the maximum stack size (64 Mbytes), or the memory of the thread
+    could not be allocated.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +516,67 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Return the current time.
+
+  This is the time of a monotonic, high-resolution clock, in microseconds.
+  It is the time base of @c SleepUntil.
+
+  @returns the current time in microseconds
+  */
+unsigned long GetTime();
+
+/**
+  @brief Suspend the current thread for a time interval.
+
+  The current thread sleeps for at least @c usec microseconds. It may
+  wake up later, by up to its timer slack.
+
+  @param usec the sleep duration in microseconds
+  @see SetTimerSlack
+  */
+void Sleep(unsigned long usec);
+
+/**
+  @brief Suspend the current thread until a point in time.
+
+  The current thread sleeps until @c GetTime() returns at least @c abs_usec.
+  If this time has passed, the call returns immediately.
+
+  @param abs_usec the wakeup time, in microseconds
+  @see GetTime
+  */
+void SleepUntil(unsigned long abs_usec);
+
+/**
+  @brief Set the timer slack of the current thread.
+
+  The timer slack is the amount of time (in microseconds) by which the
+  timeouts of the current thread (e.g., in @c Cond_TimedWait) may expire late.
+  The kernel uses this freedom to batch nearby timeouts into a single
+  wakeup. A larger slack means fewer wakeups, a slack of 0 means
+  timeouts as precise as possible. For each timeout, the slack used is
+  at most 1/8 of the timeout, so that short timeouts stay precise.
+
+  @param slack the new timer slack, in microseconds
+  @returns the previous timer slack of the thread
+  */
+unsigned int SetTimerSlack(unsigned int slack);
+
+/**
+  @brief A preemption check point.
+
+  When the kernel runs in cooperative preemption mode, a thread is preempted
+  at the end of its quantum only when it reaches a check point. CPU-bound
+  code should call this function regularly, else it is preempted by a timer
+  signal, after a grace period.
+  In the default (signal) preemption mode, this call does nothing.
+
+  This is not a system call, it does not enter the kernel: unless the
+  quantum has ended, it only reads the time.
+  */
+void PreemptPoint();
+
 
 
 /*******************************************
@@ -706,6 +909,22 @@ int ShutDown(Fid_t sock, shutdown_mode how);
   */
 #define PROCINFO_MAX_ARGS_SIZE (128)
 
+/**
+  @brief Resource usage of a process.
+
+  This is the resource usage of all threads of a process, live and exited.
+  */
+typedef struct proc_usage
+{
+  unsigned long cpu_time;         /**< @brief CPU time used, in microseconds */
+  unsigned long ctx_switches;     /**< @brief Number of context switches away from the threads */
+  unsigned long threads_created;  /**< @brief Number of threads created, including the main thread */
+  unsigned long peak_threads;     /**< @brief Maximum number of threads at any time */
+  unsigned long stack_bytes;      /**< @brief Stack memory of the current threads */
+  unsigned long bytes_read;       /**< @brief Bytes read from streams */
+  unsigned long bytes_written;    /**< @brief Bytes written to streams */
+} proc_usage;
+
 /**
 	@brief A struct containing process-related information for a non-free
 	pid.
@@ -736,6 +955,8 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  proc_usage usage; /**< @brief The resource usage of the process. */
 } procinfo;
 
 
@@ -747,7 +968,9 @@ typedef struct procinfo
 	each packed into a block of size @c sizeof(procinfo).
 
 	Each procinfo structure contains information pertaining to some
-	used PCB (active or zombie) during the time of the stream. 
+	live process, or zombie process not yet reaped, during the time of
+	the stream. For a zombie, @c thread_count and @c argl are 0, and no 
+	arguments are returned, since they are released when it exits. 
 
 	There is no guarantee of the timeliness of the information.
 	A best-effort approach to return relevant system information is